@@ -0,0 +1,114 @@
+//
+// Created by richard on 2019-04-26.
+//
+
+// Async stream benchmark: thousands of output streams, each a filter_streambuf over an fd_streambuf on one end of a
+// non-blocking socketpair, written by coroutines on one thread with exp::async_ostream while reader coroutines drain
+// the other ends. Usage: async_sockets [streams] [lines_per_stream]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "../include/async_stream.h"
+#include "../include/fd_streambuf.h"
+
+namespace {
+
+    struct connection {
+        int fds[2]{-1, -1};
+        exp::fd_streambuf sink;
+        exp::filter_streambuf filter{&sink};
+        size_t received{0};
+
+        explicit connection(const int (&pair)[2]) : fds{pair[0], pair[1]}, sink{pair[0]} {}
+    };
+
+    exp::epoll_executor::task writer(exp::epoll_executor &executor, connection &c, size_t lines, size_t &written) {
+        exp::async_ostream out{executor, &c.filter, c.fds[0]};
+        std::string line{};
+        for (size_t i = 0; i < lines; ++i) {
+            line = "stream " + std::to_string(c.fds[0]) + " line " + std::to_string(i) +
+                   " some payload text to make the line a little longer\n";
+            if (!co_await out.write(line))
+                break;
+            written += line.size();
+        }
+        co_await out.flush();
+        executor.forget(c.fds[0]);
+        ::shutdown(c.fds[0], SHUT_WR);
+    }
+
+    exp::epoll_executor::task reader(exp::epoll_executor &executor, connection &c) {
+        char buffer[16 * 1024];
+        for (;;) {
+            auto n = ::read(c.fds[1], buffer, sizeof(buffer));
+            if (n > 0) {
+                c.received += static_cast<size_t>(n);
+            } else if (n < 0 && errno == EAGAIN) {
+                if (!co_await executor.readable(c.fds[1]))
+                    break;
+            } else if (!(n < 0 && errno == EINTR)) {
+                break;
+            }
+        }
+        executor.forget(c.fds[1]);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t streams = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4000;
+    size_t lines = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000;
+
+    rlimit limit{};
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+    streams = std::min<size_t>(streams, (limit.rlim_cur - 16) / 2);
+
+    std::vector<std::unique_ptr<connection>> connections{};
+    for (size_t s = 0; s < streams; ++s) {
+        int pair[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) != 0) {
+            std::cerr << "socketpair: " << std::strerror(errno) << '\n';
+            return 1;
+        }
+        int size = 16 * 1024;
+        ::setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        connections.push_back(std::make_unique<connection>(pair));
+    }
+
+    exp::epoll_executor executor{};
+    size_t written = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto &c : connections) {
+        executor.spawn(writer(executor, *c, lines, written));
+        executor.spawn(reader(executor, *c));
+    }
+    bool ok = executor.run();
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t received = 0;
+    for (auto &c : connections) {
+        received += c->received;
+        ::close(c->fds[0]);
+        ::close(c->fds[1]);
+    }
+    connections.clear();
+
+    std::cout << "streams " << streams << " lines/stream " << lines << '\n'
+              << "written " << written << " received " << received << (ok && written == received ? " ok" : " MISMATCH")
+              << '\n'
+              << std::fixed << std::setprecision(3) << seconds << " s, "
+              << std::setprecision(1) << static_cast<double>(received) / seconds / 1e6 << " MB/s, "
+              << static_cast<double>(streams * lines) / seconds / 1e6 << " M lines/s\n";
+    return ok && written == received ? 0 : 1;
+}
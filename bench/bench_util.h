@@ -0,0 +1,40 @@
+//
+// Created by richard on 2019-04-20.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace bench {
+
+    /**
+     * @brief Run body(t) on thread_count threads, t counting from 0.
+     * @return the wall clock time until the last thread finished, in seconds.
+     */
+    template<typename Body>
+    double run_threads(size_t thread_count, Body body) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads{};
+        for (size_t t = 0; t < thread_count; ++t)
+            threads.emplace_back(body, t);
+        for (auto &thread : threads)
+            thread.join();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /**
+     * @brief Run body(i) for i from 0 to repetitions - 1 on the calling thread.
+     * @return the time taken, in seconds.
+     */
+    template<typename Body>
+    double time_run(size_t repetitions, Body body) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < repetitions; ++i)
+            body(i);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
@@ -0,0 +1,78 @@
+//
+// Created by richard on 2019-04-10.
+//
+
+// Contention benchmark: many threads logging to one sink, through a mutex-wrapped std::ostream and through
+// exp::log_sink front ends. Both paths write to the file only when its 64 KiB buffer fills, and once at the end,
+// so they make the same system calls. Usage: log_contention [records_per_thread] [output_path]
+
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../include/fd_streambuf.h"
+#include "../include/log_stream.h"
+#include "bench_util.h"
+
+namespace {
+
+    using bench::run_threads;
+
+    double flush_time(std::ostream &out) {
+        auto start = std::chrono::steady_clock::now();
+        out.flush();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    double mutex_ostream(const char *path, size_t thread_count, size_t records) {
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        exp::fd_streambuf sink{fd, 64 * 1024, true};
+        std::ostream out{&sink};
+        std::mutex mutex{};
+
+        return run_threads(thread_count, [&](size_t t) {
+            for (size_t i = 0; i < records; ++i) {
+                std::lock_guard<std::mutex> lock{mutex};
+                out << "thread " << t << " record " << i << " value " << i * 31 + t << '\n';
+            }
+        }) + flush_time(out);
+    }
+
+    double log_stream(const char *path, size_t thread_count, size_t records) {
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        exp::fd_streambuf sink{fd, 64 * 1024, true};
+        // The consumer syncs its destination whenever the queue empties; this filter defers that to the end.
+        exp::filter_streambuf deferred{&sink, exp::flush_policy{exp::flush_trigger::close}};
+        auto start = std::chrono::steady_clock::now();
+        {
+            exp::log_sink log{&deferred};
+            run_threads(thread_count, [&](size_t t) {
+                auto &out = log.local();
+                for (size_t i = 0; i < records; ++i)
+                    out << "thread " << t << " record " << i << " value " << i * 31 + t << '\n' << std::flush;
+            });
+        }
+        deferred.close();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t records = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    const char *path = argc > 2 ? argv[2] : "/dev/null";
+
+    std::cout << "threads  mutex_ostream(rec/s)  log_sink(rec/s)  speedup\n";
+    for (size_t threads = 1; threads <= 64; threads *= 2) {
+        auto total = static_cast<double>(threads * records);
+        auto locked = mutex_ostream(path, threads, records);
+        auto lock_free = log_stream(path, threads, records);
+        std::cout << std::setw(7) << threads
+                  << std::setw(22) << static_cast<size_t>(total / locked)
+                  << std::setw(17) << static_cast<size_t>(total / lock_free)
+                  << std::setw(9) << std::fixed << std::setprecision(2) << locked / lock_free << '\n';
+    }
+    return 0;
+}
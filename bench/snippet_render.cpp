@@ -0,0 +1,77 @@
+//
+// Created by richard on 2019-04-20.
+//
+
+// Snippet benchmark: a boilerplate accessor emitted at several nesting depths, once as a sequence of << insertions
+// into a fmtstream and once by rendering a precompiled fmt::snippet. Usage: snippet_render [repetitions]
+
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include "../include/fd_streambuf.h"
+#include "../include/snippet.h"
+#include "bench_util.h"
+
+namespace {
+
+    using bench::time_run;
+
+    const char *const names[] = {"width", "height", "depth", "colour", "texture_name", "parent"};
+    const char *const types[] = {"int", "int", "int", "uint32_t", "std::string", "node *"};
+
+    double insertions(std::streambuf *sink, size_t depth, size_t repetitions) {
+        fmt::fmtstream out{sink};
+        for (size_t level = 0; level < depth; ++level)
+            out.indent();
+        return time_run(repetitions, [&](size_t i) {
+            auto name = names[i % 6];
+            auto type = types[i % 6];
+            out << type << " get_" << name << "() const {" << fmt::indent << fmt::eol
+                << "return " << name << "_;" << fmt::eol
+                << fmt::undent << "}" << fmt::eol
+                << "void set_" << name << "(" << type << " value) {" << fmt::indent << fmt::eol
+                << name << "_ = value;" << fmt::eol
+                << "changed(\"" << name << "\");" << fmt::eol
+                << fmt::undent << "}" << fmt::eol;
+        });
+    }
+
+    double snippets(std::streambuf *sink, size_t depth, size_t repetitions) {
+        static const fmt::snippet accessor{
+                "{{type}} get_{{name}}() const {\x0f\n"
+                "return {{name}}_;\n"
+                "\x0e}\n"
+                "void set_{{name}}({{type}} value) {\x0f\n"
+                "{{name}}_ = value;\n"
+                "changed(\"{{name}}\");\n"
+                "\x0e}\n"};
+        auto type_slot = accessor.slot_index("type");
+        fmt::fmtstream out{sink};
+        for (size_t level = 0; level < depth; ++level)
+            out.indent();
+        return time_run(repetitions, [&](size_t i) {
+            std::string_view values[2];
+            values[type_slot] = types[i % 6];
+            values[1 - type_slot] = names[i % 6];
+            accessor.render(*out.formatter(), values, 2);
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t repetitions = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+    exp::fd_streambuf sink{::open("/dev/null", O_WRONLY), 64 * 1024, true};
+
+    std::cout << "depth  insertions(ops/s)  snippet(ops/s)  speedup\n";
+    for (size_t depth = 0; depth <= 16; depth += 4) {
+        auto inserted = insertions(&sink, depth, repetitions);
+        auto rendered = snippets(&sink, depth, repetitions);
+        std::cout << std::setw(5) << depth
+                  << std::setw(19) << static_cast<size_t>(static_cast<double>(repetitions) / inserted)
+                  << std::setw(16) << static_cast<size_t>(static_cast<double>(repetitions) / rendered)
+                  << std::setw(9) << std::fixed << std::setprecision(2) << inserted / rendered << '\n';
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+//
+// Created by richard on 2019-04-12.
+//
+
+// Scaling benchmark: threads writing indented code to one sink, through a shared fmtstream with a global lock
+// taken for each insertion, and through per-thread fmt::sync_fmtstream writers committing whole lines.
+// Usage: sync_fmt_scaling [functions_per_thread] [output_path]
+
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../include/fd_streambuf.h"
+#include "../include/sync_fmtstream.h"
+#include "bench_util.h"
+
+namespace {
+
+    using bench::run_threads;
+
+    double locked_fmtstream(const char *path, size_t thread_count, size_t functions) {
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        exp::fd_streambuf sink{fd, 64 * 1024, true};
+        fmt::fmtstream out{&sink};
+        std::mutex mutex{};
+
+        return run_threads(thread_count, [&](size_t t) {
+            auto locked = [&](auto &&value) {
+                std::lock_guard<std::mutex> lock{mutex};
+                out << value;
+            };
+            for (size_t i = 0; i < functions; ++i) {
+                locked("int function_");
+                locked(t);
+                locked('_');
+                locked(i);
+                locked("() ");
+                locked(fmt::begin('{'));
+                locked("return ");
+                locked(i * 31 + t);
+                locked(";");
+                locked(fmt::end('}'));
+            }
+        });
+    }
+
+    double sync_fmtstream(const char *path, size_t thread_count, size_t functions) {
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        exp::fd_streambuf sink{fd, 64 * 1024, true};
+        fmt::sync_sink shared{&sink};
+
+        return run_threads(thread_count, [&](size_t t) {
+            fmt::sync_fmtstream out{shared};
+            for (size_t i = 0; i < functions; ++i) {
+                out << "int function_" << t << '_' << i << "() " << fmt::begin('{')
+                    << "return " << i * 31 + t << ";" << fmt::end('}');
+            }
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t functions = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+    const char *path = argc > 2 ? argv[2] : "/dev/null";
+
+    std::cout << "threads  locked_fmtstream(fn/s)  sync_fmtstream(fn/s)  speedup\n";
+    for (size_t threads = 1; threads <= 64; threads *= 2) {
+        auto total = static_cast<double>(threads * functions);
+        auto locked = locked_fmtstream(path, threads, functions);
+        auto synced = sync_fmtstream(path, threads, functions);
+        std::cout << std::setw(7) << threads
+                  << std::setw(24) << static_cast<size_t>(total / locked)
+                  << std::setw(22) << static_cast<size_t>(total / synced)
+                  << std::setw(9) << std::fixed << std::setprecision(2) << locked / synced << '\n';
+    }
+    return 0;
+}
@@ -0,0 +1,292 @@
+//
+// Created by richard on 2019-04-08.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "streams.h"
+
+namespace exp {
+
+    /**
+     * @brief What an async_filter_streambuf does when a full put area is handed off while every pool buffer is
+     * waiting for the background thread. An explicit sync() or flush_and_wait() always waits.
+     */
+    enum class overflow_policy {
+        block,      ///< Wait for the background thread to release a buffer.
+        drop,       ///< Discard the buffer being handed off and continue; see async_filter_streambuf::dropped().
+    };
+
+    /**
+     * @brief Construction options for async_filter_streambuf.
+     */
+    struct async_options {
+        size_t buffer_count{4};                          ///< Number of write buffers, at least 2.
+        overflow_policy policy{overflow_policy::block};  ///< Behaviour when all buffers are busy.
+    };
+
+    /**
+     * @brief Moves the filter_write() of a filter stream buffer onto a background thread.
+     * @details Wraps Filter, a basic_filter_streambuf or a class derived from it. When the put area is handed
+     * off by sync() or overflow() it is queued for a background thread, which calls Filter::filter_write() to
+     * pass it to the next buffer, and the producer continues into a fresh buffer from a small fixed pool.
+     * Memory is bounded by the pool; when every buffer is queued the overflow_policy decides whether the
+     * producer waits or the output is dropped. The next buffer is only touched by the background thread
+     * once the stream buffer is constructed: flushes made by the flush policy queue a request to synchronize
+     * it, and when it would block the background thread waits for it to take the rest of the output, so the
+     * stream itself never blocks; would_block() is true meanwhile. flush_and_wait() returns once everything
+     * written so far has been filtered and the next buffer synchronized.
+     * @tparam Filter the filter stream buffer type to wrap.
+     */
+    template<typename Filter>
+    class async_filter_streambuf : public Filter {
+    public:
+        typedef typename Filter::char_type char_type;
+        typedef typename Filter::traits_type traits_type;
+        typedef typename Filter::int_type int_type;
+        typedef typename Filter::pos_type pos_type;
+        typedef typename Filter::off_type off_type;
+
+        /**
+         * @brief (constructor)
+         * @param options the buffer pool size and overflow policy.
+         * @param args the arguments for the Filter constructor, starting with the next buffer.
+         */
+        template<typename... Args>
+        explicit async_filter_streambuf(const async_options &options, Args &&... args)
+                : Filter(std::forward<Args>(args)...), policy{options.policy},
+                  pool(std::max<size_t>(options.buffer_count, 2) * Filter::write_buffer_size) {
+            // The Filter's own write buffer is never taken; the put area is always one of the pool.
+            for (size_t idx = Filter::write_buffer_size; idx < pool.size(); idx += Filter::write_buffer_size)
+                free_buffers.push_back(pool.data() + idx);
+            this->set_put_buffer(pool.data(), Filter::write_buffer_size);
+            worker = std::thread{[this] { run(); }};
+        }
+
+        /**
+         * @brief (destructor)
+         * @details Waits for all queued output to be filtered, then stops the background thread.
+         */
+        ~async_filter_streambuf() override {
+            this->cancel_deadline();
+            flush_and_wait();
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                stopping = true;
+            }
+            work_cv.notify_all();
+            worker.join();
+            this->setp(nullptr, nullptr);
+        }
+
+        /**
+         * @brief Hand off buffered output and wait until the background thread has filtered everything
+         * written so far and synchronized the next buffer.
+         * @return -1 if the filter or the next buffer reported an error, 0 otherwise.
+         */
+        int flush_and_wait() {
+            {
+                auto lock = this->guard();
+                hand_off(false);
+            }
+            std::unique_lock<std::mutex> lock{mutex};
+            auto ticket = ++flush_requested;
+            queue.push_back(job{nullptr, 0, ticket});
+            work_cv.notify_all();
+            done_cv.wait(lock, [&] { return flush_completed >= ticket; });
+            return failed ? -1 : 0;
+        }
+
+        /**
+         * @brief The number of characters discarded under overflow_policy::drop.
+         */
+        size_t dropped() const {
+            std::lock_guard<std::mutex> lock{mutex};
+            return dropped_count;
+        }
+
+        /**
+         * @brief True while the background thread waits for a next buffer which would block.
+         * @details Output written meanwhile is still accepted into the pool buffers; once every buffer is
+         * queued a write waits for the background thread, or is dropped, as the overflow_policy says.
+         */
+        bool would_block() const override {
+            return stalled.load(std::memory_order_acquire);
+        }
+
+        /**
+         * @brief The number of characters buffered or queued for the background thread.
+         */
+        size_t pending_bytes() const override {
+            std::lock_guard<std::mutex> lock{mutex};
+            auto pending = static_cast<size_t>(this->pptr() - this->pbase());
+            for (auto &item : queue)
+                pending += static_cast<size_t>(item.count);
+            return pending;
+        }
+
+        /**
+         * @brief The background thread resumes the next buffer itself; this only reports whether it still waits.
+         * @return false if the background thread waits for the next buffer, or the filter or the next buffer
+         * has reported an error.
+         */
+        bool resume() override {
+            std::lock_guard<std::mutex> lock{mutex};
+            return !failed && !would_block();
+        }
+
+    protected:
+        struct job {
+            char_type *buffer;          ///< The output to filter, or nullptr to synchronize the next buffer.
+            std::streamsize count;
+            size_t ticket;              ///< The flush_and_wait() call waiting for a synchronization, or 0.
+        };
+
+        overflow_policy policy;
+        std::vector<char_type> pool;
+        std::vector<char_type *> free_buffers{};
+        std::deque<job> queue{};
+        mutable std::mutex mutex{};
+        std::condition_variable work_cv{};
+        std::condition_variable done_cv{};
+        size_t flush_requested{0};
+        size_t flush_completed{0};
+        size_t dropped_count{0};
+        bool stopping{false};
+        bool failed{false};
+        std::atomic<bool> stalled{false};   ///< The background thread waits for a next buffer which would block.
+        std::thread worker{};
+
+        /**
+         * @brief Queue the put area for the background thread and continue in a free buffer.
+         * @param may_drop true if the output may be discarded under overflow_policy::drop.
+         * @return -1 if an earlier filter_write failed, 0 otherwise.
+         */
+        int hand_off(bool may_drop) {
+            auto count = this->pptr() - this->pbase();
+            std::unique_lock<std::mutex> lock{mutex};
+            if (!count)
+                return failed ? -1 : 0;
+
+            if (may_drop && free_buffers.empty() && policy == overflow_policy::drop) {
+                dropped_count += static_cast<size_t>(count);
+                this->set_put_area(0);
+                return failed ? -1 : 0;
+            }
+
+            queue.push_back(job{this->pbase(), count, 0});
+            work_cv.notify_all();
+            done_cv.wait(lock, [this] { return !free_buffers.empty(); });
+            auto buffer = free_buffers.back();
+            free_buffers.pop_back();
+            this->set_put_buffer(buffer, Filter::write_buffer_size);
+            return failed ? -1 : 0;
+        }
+
+        /**
+         * @brief Hand off the put area, waiting for a free buffer whatever the overflow_policy.
+         */
+        int sync() override {
+            auto lock = this->guard();
+            return hand_off(false);
+        }
+
+        /**
+         * @brief Queue a request for the background thread to synchronize the next buffer, without waiting.
+         * @return -1 if an earlier filter_write or synchronization failed, 0 otherwise.
+         */
+        int sync_next() override {
+            std::lock_guard<std::mutex> lock{mutex};
+            queue.push_back(job{nullptr, 0, 0});
+            work_cv.notify_all();
+            return failed ? -1 : 0;
+        }
+
+        /**
+         * @brief Hand off the put area, applying the overflow_policy only when it is full; flushes made by the
+         * flush policy or the deadline timer wait for a free buffer.
+         */
+        bool pass_through(bool full) override {
+            return hand_off(full) == 0;
+        }
+
+        /**
+         * @brief On the background thread, wait until a next buffer which would block has passed on what it
+         * holds.
+         * @return false if the next buffer failed, or is not blocked so that waiting would not help.
+         */
+        bool wait_for_next() {
+            auto resumable = this->next_resumable;
+            if (!resumable || !resumable->would_block())
+                return false;
+            stalled.store(true, std::memory_order_release);
+            auto delay = std::chrono::microseconds{50};
+            bool ok = true;
+            while (ok && !resumable->resume()) {
+                ok = resumable->would_block();
+                if (ok) {
+                    std::this_thread::sleep_for(delay);
+                    delay = std::min(delay * 2, std::chrono::microseconds{10000});
+                }
+            }
+            stalled.store(false, std::memory_order_release);
+            return ok;
+        }
+
+        /**
+         * @brief The background thread: filter queued buffers into the next buffer, in order.
+         */
+        void run() {
+            std::unique_lock<std::mutex> lock{mutex};
+            while (true) {
+                work_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+
+                auto item = queue.front();
+                queue.pop_front();
+                lock.unlock();
+
+                bool ok = true;
+                if (item.buffer) {
+                    for (std::streamsize done = 0; ok && done < item.count;) {
+                        auto n = this->filter_write(item.buffer + done, item.count - done);
+                        if (n > 0)
+                            done += n;
+                        else
+                            ok = n == 0 && wait_for_next();
+                    }
+                } else {
+                    ok = this->next->pubsync() == 0;
+                    if (ok && this->next_resumable && this->next_resumable->would_block())
+                        ok = wait_for_next();
+                }
+
+                lock.lock();
+                failed = failed || !ok;
+                if (item.buffer)
+                    free_buffers.push_back(item.buffer);
+                else
+                    flush_completed = std::max(flush_completed, item.ticket);
+                done_cv.notify_all();
+            }
+        }
+    };
+
+    template<
+            typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            size_t WriteBufferSize = 4096,
+            size_t ReadBufferSize = 4096>
+    using basic_async_filter_streambuf =
+            async_filter_streambuf<basic_filter_streambuf<CharT, Traits, WriteBufferSize, ReadBufferSize>>;
+}
@@ -0,0 +1,355 @@
+//
+// Created by richard on 2019-04-26.
+//
+
+#pragma once
+
+// Requires C++20 coroutines.
+
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <string_view>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "streams.h"
+
+namespace exp {
+
+    /**
+     * @brief A single threaded executor which resumes coroutines waiting for file descriptors with epoll(7).
+     * @details Coroutines are started with spawn() and run on the thread calling run(), which returns when
+     * they have all finished. A coroutine waiting on a file descriptor is resumed when it becomes ready;
+     * only one coroutine may wait on a given file descriptor at a time.
+     */
+    class epoll_executor {
+    public:
+        /**
+         * @brief Something waiting for a file descriptor to become ready.
+         */
+        class waiter {
+        public:
+            virtual ~waiter() = default;
+
+            /**
+             * @brief Called by run() when the file descriptor is ready or has an error.
+             */
+            virtual void ready() = 0;
+        };
+
+        /**
+         * @brief The coroutine type of spawned tasks; a task starts when run() reaches it and destroys
+         * itself when it finishes.
+         */
+        class task {
+        public:
+            struct promise_type {
+                epoll_executor *executor{nullptr};
+
+                task get_return_object() {
+                    return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+                }
+
+                std::suspend_always initial_suspend() noexcept { return {}; }
+
+                auto final_suspend() noexcept {
+                    struct finished {
+                        bool await_ready() noexcept { return false; }
+
+                        void await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                            auto executor = handle.promise().executor;
+                            handle.destroy();
+                            if (executor)
+                                --executor->live_tasks;
+                        }
+
+                        void await_resume() noexcept {}
+                    };
+                    return finished{};
+                }
+
+                void return_void() {}
+
+                void unhandled_exception() {
+                    std::terminate();
+                }
+            };
+
+            task(task &&other) noexcept : handle{other.handle} {
+                other.handle = nullptr;
+            }
+
+            task &operator=(task &&) = delete;
+
+            ~task() {
+                if (handle)
+                    handle.destroy();
+            }
+
+        protected:
+            friend class epoll_executor;
+
+            explicit task(std::coroutine_handle<promise_type> handle) : handle{handle} {}
+
+            std::coroutine_handle<promise_type> handle;
+        };
+
+        /**
+         * @brief A waiter which resumes a coroutine.
+         */
+        class resumer : public waiter {
+        public:
+            explicit resumer(std::coroutine_handle<> handle = nullptr) : handle{handle} {}
+
+            void ready() override {
+                handle.resume();
+            }
+
+            std::coroutine_handle<> handle;
+        };
+
+        /**
+         * @brief An awaitable which suspends until a file descriptor is ready for the given events.
+         */
+        class readiness {
+        public:
+            readiness(epoll_executor &executor, int fd, std::uint32_t events)
+                    : executor{executor}, fd{fd}, events{events} {}
+
+            bool await_ready() const noexcept { return false; }
+
+            /**
+             * @return false, resuming at once, if the file descriptor can not be waited on.
+             */
+            bool await_suspend(std::coroutine_handle<> handle) {
+                resume.handle = handle;
+                failed = !executor.wait(fd, events, &resume);
+                return !failed;
+            }
+
+            /**
+             * @return false if the file descriptor could not be waited on.
+             */
+            bool await_resume() const noexcept { return !failed; }
+
+        protected:
+            epoll_executor &executor;
+            int fd;
+            std::uint32_t events;
+            resumer resume{};
+            bool failed{false};
+        };
+
+        epoll_executor() : epoll_fd{::epoll_create1(EPOLL_CLOEXEC)} {}
+
+        epoll_executor(const epoll_executor &) = delete;
+        epoll_executor &operator=(const epoll_executor &) = delete;
+
+        ~epoll_executor() {
+            for (auto handle : ready_tasks)
+                handle.destroy();
+            ::close(epoll_fd);
+        }
+
+        /**
+         * @brief Queue a task to start when run() is called.
+         */
+        void spawn(task &&t) {
+            t.handle.promise().executor = this;
+            ++live_tasks;
+            ready_tasks.push_back(t.handle);
+            t.handle = nullptr;
+        }
+
+        /**
+         * @brief Call w->ready() once when fd is ready for events, which are epoll events such as EPOLLOUT.
+         * @return false if the file descriptor can not be waited on.
+         */
+        bool wait(int fd, std::uint32_t events, waiter *w) {
+            epoll_event event{};
+            event.events = events | EPOLLONESHOT;
+            event.data.ptr = w;
+            if (::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) != 0 &&
+                (errno != ENOENT || ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0))
+                return false;
+            ++waiting;
+            return true;
+        }
+
+        /**
+         * @brief Stop watching a file descriptor; call before closing it if it has been waited on.
+         */
+        void forget(int fd) {
+            ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+
+        readiness writable(int fd) {
+            return readiness{*this, fd, EPOLLOUT};
+        }
+
+        readiness readable(int fd) {
+            return readiness{*this, fd, EPOLLIN};
+        }
+
+        /**
+         * @brief Run spawned tasks until all have finished.
+         * @return false if epoll_wait(2) failed or tasks are left waiting for nothing.
+         */
+        bool run() {
+            epoll_event events[256];
+            while (live_tasks) {
+                while (!ready_tasks.empty()) {
+                    auto handle = ready_tasks.front();
+                    ready_tasks.pop_front();
+                    handle.resume();
+                }
+                if (!live_tasks)
+                    break;
+                if (!waiting)
+                    return false;
+
+                auto n = ::epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                waiting -= static_cast<size_t>(n);
+                for (int idx = 0; idx < n; ++idx)
+                    static_cast<waiter *>(events[idx].data.ptr)->ready();
+            }
+            return true;
+        }
+
+    protected:
+        int epoll_fd;
+        size_t live_tasks{0};
+        size_t waiting{0};
+        std::deque<std::coroutine_handle<>> ready_tasks{};
+    };
+
+    /**
+     * @brief An awaitable interface to a chain of stream buffers, such as basic_filter_streambuf filters ending
+     * in a basic_fd_streambuf, which writes to a non-blocking file descriptor.
+     * @details co_await write(text) and co_await flush() complete at once while the chain accepts the output;
+     * when it would block they suspend the coroutine until the file descriptor is writable, resume the
+     * chain through its resumable_sink interface and carry on. Buffers without that interface are written as
+     * usual. The chain can still be used synchronously, through an ostream, by code which is not a coroutine.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_async_ostream {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef std::basic_string_view<CharT, Traits> string_view_type;
+
+        basic_async_ostream() = delete;
+
+        /**
+         * @brief (constructor)
+         * @param executor the executor which resumes coroutines waiting on this stream.
+         * @param head the first buffer of the chain.
+         * @param fd the non-blocking file descriptor the chain writes to.
+         */
+        basic_async_ostream(epoll_executor &executor, std::basic_streambuf<CharT, Traits> *head, int fd)
+                : executor{executor}, head{head}, resumable{resumable_sink_of(head)}, fd{fd} {}
+
+        /**
+         * @brief The awaitable returned by write() and flush(); co_await yields false if the chain failed.
+         */
+        class operation : public epoll_executor::waiter {
+        public:
+            operation(basic_async_ostream &stream, string_view_type text, bool flushing)
+                    : stream{stream}, text{text}, flushing{flushing} {}
+
+            bool await_ready() {
+                return attempt();
+            }
+
+            bool await_suspend(std::coroutine_handle<> coroutine) {
+                handle = coroutine;
+                failed = !stream.executor.wait(stream.fd, EPOLLOUT, this);
+                return !failed;
+            }
+
+            bool await_resume() const noexcept {
+                return !failed;
+            }
+
+            void ready() override {
+                if (!attempt()) {
+                    failed = !stream.executor.wait(stream.fd, EPOLLOUT, this);
+                    if (!failed)
+                        return;
+                }
+                handle.resume();
+            }
+
+        protected:
+            basic_async_ostream &stream;
+            string_view_type text;
+            bool flushing;
+            bool failed{false};
+            std::coroutine_handle<> handle{};
+
+            /**
+             * @brief Write as much as the chain accepts.
+             * @return true if the operation is complete or failed, false if it would block.
+             */
+            bool attempt() {
+                auto resumable = stream.resumable;
+                if (resumable && resumable->would_block() && !resumable->resume())
+                    return failed = !resumable->would_block();
+
+                while (!text.empty()) {
+                    auto n = stream.head->sputn(text.data(), static_cast<std::streamsize>(text.size()));
+                    text.remove_prefix(static_cast<size_t>(std::max<std::streamsize>(n, 0)));
+                    if (text.empty())
+                        break;
+                    if (!resumable || !resumable->would_block())
+                        return failed = true;
+                    if (!resumable->resume())
+                        return failed = !resumable->would_block();
+                }
+
+                if (flushing) {
+                    if (stream.head->pubsync() != 0)
+                        return failed = true;
+                    if (resumable && resumable->would_block())
+                        return false;
+                }
+                return true;
+            }
+        };
+
+        /**
+         * @brief Write text, suspending while the chain would block.
+         */
+        operation write(string_view_type text) {
+            return operation{*this, text, false};
+        }
+
+        /**
+         * @brief Flush the chain to the file descriptor, suspending while it would block.
+         */
+        operation flush() {
+            return operation{*this, {}, true};
+        }
+
+        std::basic_streambuf<CharT, Traits> *rdbuf() const {
+            return head;
+        }
+
+    protected:
+        epoll_executor &executor;
+        std::basic_streambuf<CharT, Traits> *head;
+        resumable_sink *resumable;
+        int fd;
+    };
+
+    using async_ostream = basic_async_ostream<char>;
+}
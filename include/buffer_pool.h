@@ -0,0 +1,113 @@
+//
+// Created by richard on 2019-04-28.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// GCC declares exp() as a built-in function and warns about anything else with that name.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbuiltin-declaration-mismatch"
+#endif
+namespace exp {
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+    /**
+     * @brief The bounds of an adaptive stream buffer, in characters, and when its buffers go back to the pool.
+     * @details With max_size 0 the buffer has the fixed size given by the stream buffer's template arguments.
+     */
+    struct buffer_sizing {
+        size_t min_size{0};
+        size_t max_size{0};
+        bool release_write{false};      ///< Return the write buffer when a flush leaves it empty.
+        bool release_read{false};       ///< Return the read buffer when a read finds nothing to read.
+    };
+
+    namespace detail {
+
+        /**
+         * @brief A process wide pool of buffer memory in power of two size classes.
+         * @details Blocks smaller than a slab are carved from 64 KiB slabs, which are kept for the life of the
+         * process, so many small buffers cost one allocation per slab and no per-block overhead. Larger blocks
+         * are allocated singly. Released blocks are kept on a free list per size class, up to a limit of memory
+         * per class for the larger blocks, and handed out again before new memory is allocated, so streams
+         * which take, grow, shrink and return their buffers reuse each other's blocks. The pool is never
+         * destroyed, so buffers may be released during static destruction.
+         */
+        class buffer_pool {
+        public:
+            static constexpr size_t min_block = 64;                 ///< Bytes in the smallest size class.
+            static constexpr size_t class_count = 32;
+            static constexpr size_t class_limit = 8 * 1024 * 1024;   ///< Bytes kept free per large size class.
+            static constexpr size_t slab_size = 64 * 1024;
+
+            static buffer_pool &instance() {
+                static auto pool = new buffer_pool{};
+                return *pool;
+            }
+
+            /**
+             * @brief The number of bytes in the block allocate(bytes) returns.
+             */
+            static size_t block_size(size_t bytes) {
+                return min_block << size_class(bytes);
+            }
+
+            void *allocate(size_t bytes) {
+                auto index = size_class(bytes);
+                auto block_bytes = min_block << index;
+                std::lock_guard<std::mutex> lock{mutex};
+                auto &free_list = free_blocks[index];
+                if (free_list.empty()) {
+                    if (block_bytes >= slab_size)
+                        return ::operator new(block_bytes);
+                    auto slab = static_cast<char *>(::operator new(slab_size));
+                    for (auto offset = slab_size; offset >= block_bytes; offset -= block_bytes)
+                        free_list.push_back(slab + offset - block_bytes);
+                }
+                auto block = free_list.back();
+                free_list.pop_back();
+                return block;
+            }
+
+            /**
+             * @brief Return a block; bytes is the size it was allocated with.
+             */
+            void release(void *block, size_t bytes) {
+                if (!block)
+                    return;
+                auto index = size_class(bytes);
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    auto &free_list = free_blocks[index];
+                    auto block_bytes = min_block << index;
+                    if (block_bytes < slab_size || (free_list.size() + 1) * block_bytes <= class_limit) {
+                        free_list.push_back(block);
+                        return;
+                    }
+                }
+                ::operator delete(block);
+            }
+
+        protected:
+            std::mutex mutex{};
+            std::vector<void *> free_blocks[class_count]{};
+
+            buffer_pool() = default;
+
+            static size_t size_class(size_t bytes) {
+                size_t index = 0;
+                while ((min_block << index) < bytes && index + 1 < class_count)
+                    ++index;
+                return index;
+            }
+        };
+    }
+}
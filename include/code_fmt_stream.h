@@ -4,8 +4,12 @@
 
 #pragma once
 
+#include <array>
 #include <locale>
 #include <algorithm>
+#include <string>
+#include <vector>
+#include "stream_sink.h"
 
 namespace fmt {
 
@@ -16,6 +20,10 @@ namespace fmt {
         EndOfLine = 0xa,
         Indent = 0xf,
         Undent = 0xe,
+        SoftBreak = 0x1e,
+        ColumnAlign = 0x1f,
+        PrefixPush = 0x1c,
+        PrefixPop = 0x1d,
     };
 
     template<typename CharT,
@@ -26,6 +34,417 @@ namespace fmt {
         static constexpr char_type end_of_line = traits_type::to_char_type(EndOfLine);
         static constexpr char_type indent_code = traits_type::to_char_type(Indent);
         static constexpr char_type undent_code = traits_type::to_char_type(Undent);
+        static constexpr char_type soft_break_code = traits_type::to_char_type(SoftBreak);
+        static constexpr char_type column_align_code = traits_type::to_char_type(ColumnAlign);
+        static constexpr char_type prefix_push_code = traits_type::to_char_type(PrefixPush);
+        static constexpr char_type prefix_pop_code = traits_type::to_char_type(PrefixPop);
+    };
+
+    /**
+     * @brief The actions a control code can request of basic_fmtstreambuf.
+     */
+    enum class control_action : unsigned char {
+        text,           ///< Ordinary text, written as it is.
+        indent,         ///< Increase the indentation level.
+        undent,         ///< Decrease the indentation level.
+        end_of_line,    ///< Text which ends a line.
+        soft_break,     ///< A point at which a long line may be broken.
+        column_align,   ///< A tab stop aligning columns over consecutive lines.
+        prefix_push,    ///< Push the line prefix which follows, up to the next prefix_push code.
+        prefix_pop,     ///< Pop the last line prefix pushed.
+        user,           ///< Call basic_fmtstreambuf::control().
+    };
+
+    /**
+     * @brief One entry of a control_table: the character value Value requests Action.
+     */
+    template<unsigned Value, control_action Action>
+    struct control_code {
+        static_assert(Value < 256, "control codes must be in the range 0 to 255");
+        static constexpr unsigned value = Value;
+        static constexpr control_action action = Action;
+    };
+
+    /**
+     * @brief A compile time map from character values to control actions.
+     * @details Compiles to a 256 entry lookup. Character values without an entry, and characters outside that
+     * range, are control_action::text.
+     * @tparam Codes control_code entries.
+     */
+    template<typename... Codes>
+    struct control_table {
+        static constexpr std::array<control_action, 256> actions = [] {
+            std::array<control_action, 256> table{};
+            ((table[Codes::value] = Codes::action), ...);
+            return table;
+        }();
+
+        template<typename CharT, typename Traits>
+        static constexpr control_action action(CharT c) {
+            auto value = Traits::to_int_type(c);
+            return value >= 0 && value < 256 ? actions[static_cast<size_t>(value)] : control_action::text;
+        }
+
+        /**
+         * @brief The number of character values mapped to an action.
+         */
+        static constexpr size_t count_of(control_action action) {
+            size_t count = 0;
+            for (auto mapped : actions)
+                count += mapped == action;
+            return count;
+        }
+
+        /**
+         * @brief The lowest character value mapped to an action, or fallback if there is none.
+         */
+        static constexpr unsigned code_of(control_action action, unsigned fallback) {
+            for (unsigned value = 0; value < actions.size(); ++value)
+                if (actions[value] == action)
+                    return value;
+            return fallback;
+        }
+    };
+
+    /**
+     * @brief The control codes recognized by default: ControlCodes.
+     * @details Besides the line end and the indentation codes this claims 0x1c (prefix_push), 0x1d (prefix_pop),
+     * 0x1e (soft_break) and 0x1f (column_align), which earlier versions wrote as text. Output which contains
+     * those bytes as text should use classic_control_table.
+     */
+    using default_control_table = control_table<
+            control_code<EndOfLine, control_action::end_of_line>,
+            control_code<Indent, control_action::indent>,
+            control_code<Undent, control_action::undent>,
+            control_code<SoftBreak, control_action::soft_break>,
+            control_code<ColumnAlign, control_action::column_align>,
+            control_code<PrefixPush, control_action::prefix_push>,
+            control_code<PrefixPop, control_action::prefix_pop>>;
+
+    /**
+     * @brief Only the line end and the indentation codes; every other character is text.
+     */
+    using classic_control_table = control_table<
+            control_code<EndOfLine, control_action::end_of_line>,
+            control_code<Indent, control_action::indent>,
+            control_code<Undent, control_action::undent>>;
+
+    /**
+     * @brief The number of columns text occupies: code points for UTF-8 encoded char, otherwise characters.
+     */
+    template<typename CharT>
+    size_t display_width(const CharT *text, size_t count) {
+        if constexpr (sizeof(CharT) == 1) {
+            size_t continuation_bytes = 0;
+            for (size_t idx = 0; idx < count; ++idx)
+                continuation_bytes += (static_cast<unsigned char>(text[idx]) & 0xc0u) == 0x80u;
+            return count - continuation_bytes;
+        } else {
+            return count;
+        }
+    }
+
+    namespace detail {
+
+        /**
+         * @brief A stream buffer which appends everything written to it to a string.
+         */
+        template<typename CharT, typename Traits = std::char_traits<CharT>>
+        class basic_string_sink
+                : public std::basic_streambuf<CharT, Traits>, public io::basic_gather_sink<CharT, Traits> {
+        public:
+            typedef typename Traits::int_type int_type;
+            typedef typename io::basic_gather_sink<CharT, Traits>::segment_type segment_type;
+
+            std::basic_string<CharT, Traits> text{};
+
+            std::streamsize gather_write(const segment_type *segments, size_t count) override {
+                auto start = text.size();
+                for (size_t idx = 0; idx < count; ++idx)
+                    text.append(segments[idx]);
+                return static_cast<std::streamsize>(text.size() - start);
+            }
+
+        protected:
+            std::streamsize xsputn(const CharT *s, std::streamsize count) override {
+                text.append(s, static_cast<size_t>(count));
+                return count;
+            }
+
+            int_type overflow(int_type c) override {
+                if (!Traits::eq_int_type(c, Traits::eof()))
+                    text.push_back(Traits::to_char_type(c));
+                return Traits::not_eof(c);
+            }
+        };
+    }
+
+    /**
+     * @brief A stream buffer which pads the cells of consecutive lines so their tab stops line up.
+     * @details Text arrives with the characters ControlTable maps to control_action::column_align marking the
+     * end of each cell, and those it maps to control_action::end_of_line ending lines. A run is a
+     * sequence of consecutive lines containing tab stops; it is held until a line without one ends it, then
+     * written in a single pass with every cell padded to the widest cell of its column in the run. Lines
+     * without tab stops outside a run pass straight through, so memory is bounded by the longest run and
+     * the current line. sync() ends the current run, including a partial line. Padded output the next buffer
+     * does not accept is kept and written first by the next call.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table of the formatter writing to the aligner
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_column_aligner
+            : public std::basic_streambuf<CharT, Traits>, public io::basic_gather_sink<CharT, Traits> {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef typename Traits::int_type int_type;
+        typedef std::basic_string_view<CharT, Traits> segment_type;
+
+        basic_column_aligner() = delete;
+
+        explicit basic_column_aligner(std::basic_streambuf<CharT, Traits> *next)
+                : next{next}, gather{io::gather_sink_of(next)} {
+        }
+
+        ~basic_column_aligner() override {
+            sync();
+        }
+
+        /**
+         * @brief True if a run, a partial line or output not accepted by the next buffer is held.
+         */
+        bool holding() const {
+            return !run.empty() || !unsent.empty();
+        }
+
+        /**
+         * @brief Drop the run and any partial line without writing them. Output of earlier runs which the
+         * next buffer did not accept is kept.
+         */
+        void discard() {
+            run.clear();
+            widths.clear();
+            line_start = cell_start = cell_index = 0;
+        }
+
+        /**
+         * @brief Write to a different buffer from now on.
+         */
+        void next_buffer(std::basic_streambuf<CharT, Traits> *buffer) {
+            next = buffer;
+            gather = io::gather_sink_of(buffer);
+        }
+
+        std::streamsize gather_write(const segment_type *segments, size_t count) override {
+            std::streamsize total = 0;
+            for (size_t idx = 0; idx < count; ++idx) {
+                auto n = put(segments[idx].data(), static_cast<std::streamsize>(segments[idx].size()));
+                total += std::max<std::streamsize>(n, 0);
+                if (n != static_cast<std::streamsize>(segments[idx].size()))
+                    break;
+            }
+            return total;
+        }
+
+    protected:
+        std::basic_streambuf<CharT, Traits> *next;
+        io::basic_gather_sink<CharT, Traits> *gather;
+        std::basic_string<CharT, Traits> run{};     ///< The lines of the run, then the current partial line.
+        std::vector<size_t> widths{};               ///< The widest cell of each column in the run.
+        size_t line_start{0};                       ///< Where the current line starts in run.
+        size_t cell_start{0};                       ///< Where the current cell starts in run.
+        size_t cell_index{0};                       ///< The column of the current cell.
+        std::basic_string<CharT, Traits> unsent{};  ///< Padded output the next buffer did not accept.
+        size_t sent{0};                             ///< The characters of unsent already written.
+
+        static constexpr control_action action_of(char_type c) {
+            return ControlTable::template action<char_type, traits_type>(c);
+        }
+
+        static constexpr bool is_tab_stop(char_type c) {
+            return action_of(c) == control_action::column_align;
+        }
+
+        static constexpr bool is_line_end(char_type c) {
+            return action_of(c) == control_action::end_of_line;
+        }
+
+        std::streamsize xsputn(const char_type *s, std::streamsize count) override {
+            return put(s, count);
+        }
+
+        int_type overflow(int_type c) override {
+            if (traits_type::eq_int_type(c, traits_type::eof()))
+                return traits_type::not_eof(c);
+            char_type cc = traits_type::to_char_type(c);
+            return put(&cc, 1) == 1 ? c : traits_type::eof();
+        }
+
+        /**
+         * @brief Write the run, including any partial line, and start afresh.
+         * @return -1 if the next buffer did not accept it, otherwise 0.
+         */
+        int sync() override {
+            if (!drain())
+                return -1;
+            bool ok = write_run(run.size());
+            run.clear();
+            widths.clear();
+            line_start = cell_start = cell_index = 0;
+            return ok ? 0 : -1;
+        }
+
+        /**
+         * @brief Write output kept from an earlier call.
+         * @return true if none is left.
+         */
+        bool drain() {
+            if (unsent.empty())
+                return true;
+            auto left = static_cast<std::streamsize>(unsent.size() - sent);
+            auto n = std::max<std::streamsize>(next->sputn(unsent.data() + sent, left), 0);
+            sent += static_cast<size_t>(n);
+            if (n != left)
+                return false;
+            unsent.clear();
+            sent = 0;
+            return true;
+        }
+
+        /**
+         * @brief Keep the part of the segments after the first written characters, which the next buffer
+         * did not accept.
+         */
+        void keep(const segment_type *segments, size_t count, size_t written) {
+            for (size_t idx = 0; idx < count; ++idx) {
+                auto skip = std::min(written, segments[idx].size());
+                unsent.append(segments[idx].substr(skip));
+                written -= skip;
+            }
+        }
+
+        std::streamsize put(const char_type *s, std::streamsize count) {
+            if (!drain())
+                return 0;
+            std::streamsize done = 0;
+            while (done < count) {
+                auto idx = done;
+                while (idx < count && !is_line_end(s[idx]) && !is_tab_stop(s[idx]))
+                    ++idx;
+                if (idx == count) {
+                    run.append(s + done, static_cast<size_t>(count - done));
+                    return count;
+                }
+
+                if (is_tab_stop(s[idx])) {
+                    run.append(s + done, static_cast<size_t>(idx - done));
+                    auto width = display_width(run.data() + cell_start, run.size() - cell_start);
+                    if (widths.size() <= cell_index)
+                        widths.resize(cell_index + 1, 0);
+                    widths[cell_index] = std::max(widths[cell_index], width);
+                    ++cell_index;
+                    run.push_back(s[idx]);
+                    cell_start = run.size();
+                    done = idx + 1;
+                    continue;
+                }
+
+                auto line_end = idx + 1;
+                if (cell_index) {
+                    // The line joins the run.
+                    run.append(s + done, static_cast<size_t>(line_end - done));
+                    line_start = cell_start = run.size();
+                    cell_index = 0;
+                } else if (run.empty()) {
+                    // A plain line outside a run passes straight through.
+                    auto n = next->sputn(s + done, line_end - done);
+                    if (n != line_end - done)
+                        return done + std::max<std::streamsize>(n, 0);
+                } else {
+                    // A plain line ends the run. Once the run is written, or kept, only its last line is held.
+                    bool written = write_run(line_start);
+                    run.erase(0, line_start);
+                    widths.clear();
+                    line_start = cell_start = 0;
+                    if (!written)
+                        return done;
+                    segment_type rest[2]{segment_type{run},
+                                         segment_type{s + done, static_cast<size_t>(line_end - done)}};
+                    auto size = static_cast<std::streamsize>(rest[0].size() + rest[1].size());
+                    auto n = static_cast<size_t>(std::max<std::streamsize>(io::sputv(next, gather, rest, 2), 0));
+                    if (n != static_cast<size_t>(size)) {
+                        keep(rest, 1, n);
+                        run.clear();
+                        return done + static_cast<std::streamsize>(n - std::min(n, rest[0].size()));
+                    }
+                    run.clear();
+                }
+                done = line_end;
+            }
+            return count;
+        }
+
+        /**
+         * @brief Write the first end characters of the run with every cell padded to its column width.
+         * @return false if the next buffer did not accept all of it; the rest is kept in unsent.
+         */
+        bool write_run(size_t end) {
+            static constexpr size_t spaces_count = 64;
+            static const std::array<char_type, spaces_count> spaces = [] {
+                std::array<char_type, spaces_count> a{};
+                a.fill(char_type(' '));
+                return a;
+            }();
+
+            segment_type segments[64];
+            constexpr size_t max_segments = sizeof(segments) / sizeof(segments[0]);
+            size_t used = 0;
+            std::streamsize size = 0;
+            auto flush = [&] {
+                auto n = std::max<std::streamsize>(io::sputv(next, gather, segments, used), 0);
+                if (n != size)
+                    keep(segments, used, static_cast<size_t>(n));
+                used = 0;
+                size = 0;
+            };
+            auto add = [&](segment_type segment) {
+                if (used == max_segments)
+                    flush();
+                if (!unsent.empty()) {
+                    unsent.append(segment);
+                    return;
+                }
+                segments[used++] = segment;
+                size += static_cast<std::streamsize>(segment.size());
+            };
+
+            size_t column = 0;
+            for (size_t idx = 0; idx < end;) {
+                auto stop = idx;
+                while (stop < end && !is_tab_stop(run[stop]) && !is_line_end(run[stop]))
+                    ++stop;
+                if (stop < end && is_tab_stop(run[stop])) {
+                    add(segment_type{run.data() + idx, stop - idx});
+                    auto pad = widths[column] - display_width(run.data() + idx, stop - idx);
+                    for (; pad; pad -= std::min(pad, spaces_count))
+                        add(segment_type{spaces.data(), std::min(pad, spaces_count)});
+                    ++column;
+                    idx = stop + 1;
+                    continue;
+                }
+                if (stop < end)
+                    ++stop;
+                add(segment_type{run.data() + idx, stop - idx});
+                column = 0;
+                idx = stop;
+            }
+            if (used)
+                flush();
+            return unsent.empty();
+        }
     };
 
     /**
@@ -34,18 +453,33 @@ namespace fmt {
      * and calls sputn on the next stream with the result.
      * @tparam CharT the type of character the buffer will process.
      * @tparam Traits the character traits type
+     * @tparam ControlTable the control_table mapping characters to control actions
      */
     template<typename CharT,
-            typename Traits = std::char_traits<CharT>>
-    class basic_fmtstreambuf : public std::basic_streambuf<CharT, Traits> {
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_fmtstreambuf : public std::basic_streambuf<CharT, Traits>, public io::resumable_sink {
     public:
         typedef CharT char_type;
         typedef Traits traits_type;
+        typedef ControlTable control_table_type;
         typedef typename Traits::int_type int_type;
         typedef typename Traits::pos_type pos_type;
         typedef typename Traits::off_type off_type;
+        typedef std::basic_string_view<CharT, Traits> segment_type;
+
+        /**
+         * @brief The character written to end a line: the first ControlTable maps to control_action::end_of_line.
+         */
+        static constexpr char_type line_break =
+                traits_type::to_char_type(ControlTable::code_of(control_action::end_of_line, EndOfLine));
 
         size_t indent_increment{4};
+        bool keep_blank_lines{false};     ///< Pass blank lines through instead of dropping them.
+        bool raw_text{false};             ///< Only recognize line ends; use indent() and undent() instead.
+        size_t line_width{0};             ///< Lines longer than this are wrapped at soft breaks; 0 for no wrapping.
+        size_t continuation_indent{2};    ///< Additional indent levels of a line continued at a soft break.
+        bool align_columns{false};        ///< Resolve tab stops; lines are then held until they end.
 
         basic_fmtstreambuf() = delete;
 
@@ -55,7 +489,26 @@ namespace fmt {
          * @param next the next buffer in the chain
          */
         explicit basic_fmtstreambuf(std::basic_streambuf<CharT, Traits> *next)
-                : next{next} {
+                : next{next}, gather{io::gather_sink_of(next)}, aligner{next} {
+        }
+
+        /**
+         * @brief (destructor)
+         * @details Roll back any open transaction, then write out text held after a soft break, then any run
+         * of aligned lines.
+         */
+        ~basic_fmtstreambuf() override {
+            if (transaction_depth) {
+                wrapping = false;
+                breaking = false;
+                lookahead.clear();
+                lookahead_width = 0;
+                aligner.discard();
+                transaction_depth = 0;
+                set_next_buffer(committed_next);
+            }
+            if (wrapping)
+                flush_lookahead();
         }
 
         basic_fmtstreambuf &indent() {
@@ -69,12 +522,233 @@ namespace fmt {
             return *this;
         }
 
+        /**
+         * @brief Push a prefix, such as "// " or " * ", written after the indentation of every line started
+         * until it is popped.
+         * @details Prefixes accumulate: the composite prefix of the whole stack is kept in one string, so
+         * starting a line costs one more segment in the line's gather write.
+         */
+        basic_fmtstreambuf &push_prefix(std::basic_string_view<CharT, Traits> line_prefix) {
+            prefix_ends.push_back(prefix.size());
+            prefix.append(line_prefix);
+            return *this;
+        }
+
+        basic_fmtstreambuf &pop_prefix() {
+            if (!prefix_ends.empty()) {
+                prefix.resize(prefix_ends.back());
+                prefix_ends.pop_back();
+            }
+            return *this;
+        }
+
+        /**
+         * @brief The composite prefix of the prefix stack.
+         */
+        const std::basic_string<CharT, Traits> &line_prefix() const {
+            return prefix;
+        }
+
+        /**
+         * @brief The formatting state carried from one character to the next.
+         */
+        struct state_type {
+            size_t indent_level{0};
+            bool at_start_of_line{true};
+            size_t pending_indent{0};
+            size_t column{0};
+        };
+
+        state_type state() const {
+            return state_type{indent_level, at_start_of_line, pending_indent, current_column};
+        }
+
+        void state(const state_type &new_state) {
+            indent_level = new_state.indent_level;
+            at_start_of_line = new_state.at_start_of_line;
+            pending_indent = new_state.pending_indent;
+            current_column = new_state.column;
+        }
+
+        /**
+         * @brief The column the next character will be written at, counting UTF-8 sequences as one column
+         * for char. Text held after a soft break is not included.
+         */
+        size_t column() const {
+            return current_column;
+        }
+
+        /**
+         * @brief The number of columns text occupies: code points for UTF-8 encoded char, otherwise characters.
+         */
+        static size_t display_width(const char_type *text, size_t count) {
+            return fmt::display_width(text, count);
+        }
+
+        std::basic_streambuf<CharT, Traits> *next_buffer() const {
+            return next;
+        }
+
+        /**
+         * @brief True if indentation or prefix is pending, or the next buffer would block.
+         * @details When the next buffer would block, sputn() returns the number of characters it consumed;
+         * the caller keeps the rest and writes it again after resume() returns true.
+         */
+        bool would_block() const override {
+            auto resumable = io::resumable_sink_of(next);
+            return pending_indent > 0 || !pending_prefix.empty() || (resumable && resumable->would_block());
+        }
+
+        /**
+         * @brief The number of characters of pending indentation and prefix and held back by the next buffer.
+         */
+        size_t pending_bytes() const override {
+            auto resumable = io::resumable_sink_of(next);
+            return pending_indent + pending_prefix.size() + (resumable ? resumable->pending_bytes() : 0);
+        }
+
+        /**
+         * @brief Resume the next buffer, then write pending indentation and prefix.
+         * @return true if nothing is held back any more.
+         */
+        bool resume() override {
+            auto resumable = io::resumable_sink_of(next);
+            if (resumable && !resumable->resume())
+                return false;
+            if ((pending_indent > 0 || !pending_prefix.empty()) && do_indentation(pending_indent))
+                return false;
+            return !would_block();
+        }
+
+        /**
+         * @brief Where a transaction began: its nesting depth, the formatting state, the line prefix stack
+         * and the amount of output staged.
+         */
+        struct transaction_mark {
+            size_t depth;
+            state_type state;
+            size_t staged;
+            std::basic_string<char_type, traits_type> prefix;
+            std::vector<size_t> prefix_ends;
+            std::basic_string<char_type, traits_type> pending_prefix;
+            bool reading_prefix;
+            std::basic_string<char_type, traits_type> prefix_text;
+        };
+
+        /**
+         * @brief Start staging output, so that it can be committed in one write or rolled back.
+         * @details Text held after a soft break or in an aligned run is written out first. Transactions nest;
+         * output is staged in a buffer owned by the formatter, which keeps its capacity, so once it has grown
+         * neither staging nor commit allocates. The mark holds a copy of the line prefix stack.
+         * @return the mark to pass to commit_transaction() or rollback_transaction().
+         */
+        transaction_mark begin_transaction() {
+            if (wrapping)
+                flush_lookahead();
+            if (aligner.holding())
+                aligner.pubsync();
+            if (!transaction_depth++) {
+                committed_next = next;
+                set_next_buffer(&staging);
+            }
+            return transaction_mark{transaction_depth, state(), staging.text.size(), prefix, prefix_ends,
+                                    pending_prefix, reading_prefix, prefix_text};
+        }
+
+        /**
+         * @brief Keep the output of the innermost transaction; the outermost commit writes everything staged
+         * to the next buffer with one write.
+         * @param mark the mark of the innermost open transaction.
+         * @return false if the next buffer did not accept the output, which is then discarded, or if mark is
+         * not that of the innermost open transaction, which is then left open.
+         */
+        bool commit_transaction(const transaction_mark &mark) {
+            if (mark.depth != transaction_depth)
+                return false;
+            bool ok = !(wrapping && !flush_lookahead()) && !(aligner.holding() && aligner.pubsync() != 0);
+            if (--transaction_depth)
+                return ok;
+
+            set_next_buffer(committed_next);
+            auto size = static_cast<std::streamsize>(staging.text.size());
+            ok = (!size || next->sputn(staging.text.data(), size) == size) && ok;
+            staging.text.clear();
+            return ok;
+        }
+
+        /**
+         * @brief The number of transactions open.
+         */
+        size_t transaction_level() const {
+            return transaction_depth;
+        }
+
+        /**
+         * @brief Discard the output of a transaction and restore the state and line prefix stack it began with.
+         * @details Transactions nested in it which are still open are rolled back with it. A mark of a
+         * transaction which is no longer open is ignored.
+         */
+        void rollback_transaction(const transaction_mark &mark) {
+            if (!mark.depth || mark.depth > transaction_depth)
+                return;
+            wrapping = false;
+            breaking = false;
+            lookahead.clear();
+            lookahead_width = 0;
+            aligner.discard();
+            staging.text.resize(std::min(mark.staged, staging.text.size()));
+            state(mark.state);
+            prefix = mark.prefix;
+            prefix_ends = mark.prefix_ends;
+            pending_prefix = mark.pending_prefix;
+            reading_prefix = mark.reading_prefix;
+            prefix_text = mark.prefix_text;
+            transaction_depth = mark.depth - 1;
+            if (!transaction_depth) {
+                set_next_buffer(committed_next);
+                staging.text.clear();
+            }
+        }
+
     protected:
         std::basic_streambuf<CharT, Traits> *next{nullptr};
+        io::basic_gather_sink<CharT, Traits> *gather{nullptr};
         bool at_start_of_line{true};
         size_t indent_level{0};
         std::locale locale{};
+        const std::ctype<char_type> &ctype{std::use_facet<std::ctype<char_type>>(locale)};
         size_t pending_indent{0};
+        size_t current_column{0};
+        bool wrapping{false};                                   ///< Text after a soft break is being held.
+        bool breaking{false};                                   ///< The line was broken; the held text is not written.
+        std::basic_string<char_type, traits_type> lookahead{};  ///< The text held, at most line_width columns.
+        size_t lookahead_width{0};
+        detail::basic_string_sink<CharT, Traits> staging{};     ///< Output of open transactions; outlives aligner.
+        basic_column_aligner<CharT, Traits, ControlTable> aligner;  ///< Resolves tab stops when align_columns is set.
+        std::basic_string<char_type, traits_type> prefix{};     ///< The prefix stack, concatenated.
+        std::vector<size_t> prefix_ends{};                      ///< The size of prefix before each push.
+        std::basic_string<char_type, traits_type> pending_prefix{};   ///< Prefix not written with its indentation.
+        bool reading_prefix{false};                             ///< Between prefix_push codes.
+        std::basic_string<char_type, traits_type> prefix_text{};      ///< The prefix being read.
+        size_t transaction_depth{0};
+        std::basic_streambuf<CharT, Traits> *committed_next{nullptr};  ///< The next buffer during a transaction.
+
+        void set_next_buffer(std::basic_streambuf<CharT, Traits> *buffer) {
+            next = buffer;
+            gather = io::gather_sink_of(buffer);
+            aligner.next_buffer(buffer);
+        }
+
+        /**
+         * @brief Where formatted output goes: the aligner when resolving tab stops, otherwise the next buffer.
+         */
+        std::basic_streambuf<CharT, Traits> *sink() {
+            return align_columns ? &aligner : next;
+        }
+
+        io::basic_gather_sink<CharT, Traits> *sink_gather() {
+            return align_columns ? &aligner : gather;
+        }
 
         /**
          * @brief Output the number of spaces needed for indentation.
@@ -82,17 +756,64 @@ namespace fmt {
          * @return the number of spaces which could not be output and are left pending.
          */
         off_type do_indentation(off_type indentation_count) {
+            auto left = std::move(pending_prefix);
+            pending_prefix.clear();
+            return write_line(static_cast<size_t>(indentation_count), nullptr, 0, left) < 0 ? 1 : 0;
+        }
+
+        /**
+         * @brief Write indentation and a line prefix followed by a run of text to the next buffer in one gather
+         * write.
+         * @details If the next buffer accepts only part of the output, indentation which was not written
+         * is left in pending_indent and prefix in pending_prefix.
+         * @param indentation_count required spaces
+         * @param text the run of text, which contains no control codes and at most one end of line at the end.
+         * @param count the number of characters in text.
+         * @param line_prefix the prefix written after the indentation.
+         * @return the number of characters of text written, or -1 if not all the indentation was written.
+         */
+        std::streamsize write_line(size_t indentation_count, const char_type *text, std::streamsize count,
+                                   segment_type line_prefix = {}) {
             // Spaces for making indentation more efficient.
-            static char_type spaces[] = "                ";
-            static constexpr size_t spaces_count = sizeof(spaces);
+            static constexpr size_t spaces_count = 64;
+            static const std::array<char_type, spaces_count> spaces = [] {
+                std::array<char_type, spaces_count> a{};
+                a.fill(char_type(' '));
+                return a;
+            }();
+
+            segment_type segments[8];
+            constexpr size_t max_segments = sizeof(segments) / sizeof(segments[0]);
+
+            // Very deep indentation is written ahead in whole blocks of spaces.
+            size_t remaining = indentation_count;
+            while (remaining > spaces_count * (max_segments - 2)) {
+                auto n = sink()->sputn(spaces.data(), spaces_count);
+                if (n != static_cast<std::streamsize>(spaces_count)) {
+                    pending_indent = remaining - static_cast<size_t>(std::max<std::streamsize>(n, 0));
+                    pending_prefix.assign(line_prefix);
+                    return -1;
+                }
+                remaining -= spaces_count;
+            }
 
-            for (pending_indent = indentation_count;
-                 pending_indent > 0; pending_indent -= std::min(pending_indent, spaces_count))
-                if (next->sputn(spaces, std::min(pending_indent, spaces_count)) !=
-                    std::min(pending_indent, spaces_count))
-                    return pending_indent; // Can not write all characters
+            size_t used = 0;
+            for (size_t left = remaining; left; left -= segments[used++].size())
+                segments[used] = segment_type{spaces.data(), std::min(left, spaces_count)};
+            if (!line_prefix.empty())
+                segments[used++] = line_prefix;
+            if (count)
+                segments[used++] = segment_type{text, static_cast<size_t>(count)};
 
-            return 0;
+            auto n = io::sputv(sink(), sink_gather(), segments, used);
+            auto lead = remaining + line_prefix.size();
+            auto lead_written = std::min(static_cast<size_t>(std::max<std::streamsize>(n, 0)), lead);
+            pending_indent = remaining - std::min(lead_written, remaining);
+            if (lead_written < lead) {
+                pending_prefix.assign(line_prefix.substr(lead_written - std::min(lead_written, remaining)));
+                return -1;
+            }
+            return n - static_cast<std::streamsize>(lead_written);
         }
 
         /**
@@ -105,44 +826,320 @@ namespace fmt {
          */
         std::streamsize xsputn(const char_type *obuf, std::streamsize count) override {
             // Indentation left over.
-            if (pending_indent > 0) {
+            if (pending_indent > 0 || !pending_prefix.empty()) {
                 if (do_indentation(pending_indent))
                     return 0; // and still not done.
             }
 
+            // Alignment was turned off during a run.
+            if (!align_columns && aligner.holding() && aligner.pubsync() != 0)
+                return 0;
+
+            if (raw_text)
+                return put_raw(obuf, count);
+
             // Loop over the input buffer.
-            for (off_type idx = 0; idx < count; ++idx) {
-                // Indentation level increase request.
-                if (traits_type::eq(obuf[idx], control_codes<char_type, traits_type>::indent_code)) {
-                    indent();
+            off_type idx = 0;
+            while (idx < count) {
+                if (reading_prefix) {
+                    auto end = idx;
+                    while (end < count && action_of(obuf[end]) != control_action::prefix_push)
+                        ++end;
+                    prefix_text.append(obuf + idx, static_cast<size_t>(end - idx));
+                    idx = end;
+                    if (idx == count)
+                        break;
+                    push_prefix(prefix_text);
+                    prefix_text.clear();
+                    reading_prefix = false;
+                    ++idx;
                     continue;
                 }
 
-                // Indentation level decrease request.
-                if (traits_type::eq(obuf[idx], control_codes<char_type, traits_type>::undent_code)) {
-                    undent();
+                switch (action_of(obuf[idx])) {
+                    case control_action::indent:
+                        indent();
+                        ++idx;
+                        continue;
+                    case control_action::undent:
+                        undent();
+                        ++idx;
+                        continue;
+                    case control_action::user:
+                        control(obuf[idx]);
+                        ++idx;
+                        continue;
+                    case control_action::soft_break:
+                        if (line_width && !at_start_of_line) {
+                            if (wrapping && !flush_lookahead())
+                                return idx; // Can not write all characters
+                            wrapping = true;
+                        }
+                        ++idx;
+                        continue;
+                    case control_action::column_align:
+                        if (align_columns && !put_tab_stop(obuf[idx]))
+                            return idx; // Can not write all characters
+                        ++idx;
+                        continue;
+                    case control_action::prefix_push:
+                        reading_prefix = true;
+                        ++idx;
+                        continue;
+                    case control_action::prefix_pop:
+                        pop_prefix();
+                        ++idx;
+                        continue;
+                    case control_action::text:
+                    case control_action::end_of_line:
+                        break;
+                }
+
+                // Do not print whitespace at the start of a line.
+                if (at_start_of_line && skip_at_start_of_line(obuf[idx])) {
+                    ++idx;
                     continue;
                 }
 
-                if (at_start_of_line) {
-                    // Do not print whitespace at the start of a line,
-                    if (std::isspace(obuf[idx], locale)) {
-                        continue;
+                // Find the run of text up to the next control code, or including the next end of line.
+                off_type end = idx;
+                while (end < count) {
+                    auto action = action_of(obuf[end]);
+                    if (action == control_action::end_of_line) {
+                        ++end;
+                        break;
                     }
-                    // Except as the indicated indentation before the first non-space character.
-                    if (do_indentation(indent_level * indent_increment))
-                        return idx; // Can not write all characters
+                    if (action != control_action::text)
+                        break;
+                    ++end;
                 }
 
-                at_start_of_line = traits_type::eq(obuf[idx], EndOfLine);
+                if (!put_run(obuf, idx, end))
+                    return idx; // Can not write all characters
+            }
+
+            return count;
+        }
+
+        /**
+         * @brief Called for characters mapped to control_action::user by the control table.
+         * @param c the control character, which is not printed.
+         */
+        virtual void control(char_type /*c*/) {
+        }
+
+        static constexpr control_action action_of(char_type c) {
+            return ControlTable::template action<char_type, traits_type>(c);
+        }
+
+        /**
+         * @brief True if c ends a line, in raw text mode as well.
+         */
+        static constexpr bool is_line_end(char_type c) {
+            return action_of(c) == control_action::end_of_line;
+        }
 
-                if (this->next->sputn(obuf + idx, 1) != 1)
+        /**
+         * @brief The raw text form of xsputn: only line ends are recognized, so each run of text is found
+         * with a single search for the end of line when the control table has only one.
+         */
+        std::streamsize put_raw(const char_type *obuf, std::streamsize count) {
+            off_type idx = 0;
+            while (idx < count) {
+                if (at_start_of_line && skip_at_start_of_line(obuf[idx])) {
+                    ++idx;
+                    continue;
+                }
+
+                off_type end = idx;
+                if constexpr (ControlTable::count_of(control_action::end_of_line) == 1) {
+                    auto eol = traits_type::find(obuf + idx, static_cast<size_t>(count - idx), line_break);
+                    end = eol ? eol - obuf + 1 : count;
+                } else {
+                    while (end < count && !is_line_end(obuf[end]))
+                        ++end;
+                    end += end < count;
+                }
+                if (!put_run(obuf, idx, end))
                     return idx; // Can not write all characters
             }
 
             return count;
         }
 
+        /**
+         * @brief Whitespace at the start of a line is not printed, other than the end of a blank line if kept.
+         */
+        bool skip_at_start_of_line(char_type c) const {
+            return ctype.is(std::ctype_base::space, c) &&
+                   !(keep_blank_lines && is_line_end(c));
+        }
+
+        /**
+         * @brief Write one run of text, preceded by the indentation if it starts a line.
+         * @param obuf the text.
+         * @param idx the start of the run, advanced past the characters written.
+         * @param end the end of the run.
+         * @return true if the whole run was written.
+         */
+        bool put_run(const char_type *obuf, off_type &idx, off_type end) {
+            if (wrapping) {
+                auto text_end = is_line_end(obuf[end - 1]) ? end - 1 : end;
+                auto held = hold_text(obuf + idx, static_cast<size_t>(text_end - idx));
+                if (held < 0)
+                    return false;
+                idx += held;
+                if (idx != text_end)
+                    return false;
+                if (idx == end)
+                    return true;
+                if (wrapping && !flush_lookahead())
+                    return false;
+            }
+
+            // Indentation and the line prefix go before the first non-space character of a line. A kept blank
+            // line gets the prefix without its trailing spaces.
+            bool starts_line = at_start_of_line;
+            size_t indentation = 0;
+            segment_type line_prefix{};
+            if (starts_line) {
+                bool blank_line = is_line_end(obuf[idx]);
+                line_prefix = prefix;
+                while (blank_line && !line_prefix.empty() && ctype.is(std::ctype_base::space, line_prefix.back()))
+                    line_prefix.remove_suffix(1);
+                if (!blank_line || !line_prefix.empty())
+                    indentation = indent_level * indent_increment;
+                current_column = indentation + display_width(line_prefix.data(), line_prefix.size());
+            }
+            at_start_of_line = false;
+            auto n = write_line(indentation, obuf + idx, end - idx, line_prefix);
+            if (n < 0)
+                return false;
+            if (n > 0) {
+                at_start_of_line = is_line_end(obuf[idx + n - 1]);
+                current_column = at_start_of_line ? 0 : current_column +
+                                                        display_width(obuf + idx, static_cast<size_t>(n));
+            }
+            idx += n;
+            return idx == end;
+        }
+
+        /**
+         * @brief Hold text following a soft break until it is known whether it fits on the line.
+         * @details If it can not fit the line is broken at the soft break and the text written, so the
+         * lookahead never holds more than line_width columns. Once the end of line is written the break is
+         * finished by later calls however much of the output the next buffer accepts.
+         * @return the number of characters of text held or written, -1 if the held text was not written.
+         */
+        std::streamsize hold_text(const char_type *text, size_t count) {
+            auto width = display_width(text, count);
+            if (!breaking && current_column + lookahead_width + width <= line_width) {
+                lookahead.append(text, count);
+                lookahead_width += width;
+                return static_cast<std::streamsize>(count);
+            }
+
+            // Break: the held text, then this text, start a continuation line. Under a line prefix the
+            // continuation lines up with the prefix instead.
+            if (!breaking) {
+                if (sink()->sputn(&line_break, 1) != 1)
+                    return -1;
+                breaking = true;
+                pending_indent = (indent_level + (prefix.empty() ? continuation_indent : 0)) * indent_increment;
+                pending_prefix = prefix;
+                current_column = pending_indent + display_width(prefix.data(), prefix.size());
+                size_t spaces = 0;
+                while (spaces < lookahead.size() && ctype.is(std::ctype_base::space, lookahead[spaces]))
+                    ++spaces;
+                lookahead.erase(0, spaces);
+                lookahead_width = display_width(lookahead.data(), lookahead.size());
+            }
+
+            size_t skipped = 0;
+            if (lookahead.empty())
+                while (skipped < count && ctype.is(std::ctype_base::space, text[skipped]))
+                    ++skipped;
+            if (!flush_lookahead())
+                return -1;
+
+            auto n = std::max<std::streamsize>(
+                    write_line(0, text + skipped, static_cast<std::streamsize>(count - skipped)), 0);
+            current_column += display_width(text + skipped, static_cast<size_t>(n));
+            return static_cast<std::streamsize>(skipped) + n;
+        }
+
+        /**
+         * @brief Write the text held after a soft break, which fits on the current line or starts a
+         * continuation line, preceded by any indentation and prefix pending.
+         * @details Whatever the next buffer accepts is removed from the lookahead.
+         * @return false if the next buffer did not accept all of it.
+         */
+        bool flush_lookahead() {
+            if (pending_indent > 0 || !pending_prefix.empty() || !lookahead.empty()) {
+                auto lead = std::move(pending_prefix);
+                pending_prefix.clear();
+                auto size = static_cast<std::streamsize>(lookahead.size());
+                auto n = write_line(pending_indent, lookahead.data(), size, lead);
+                if (n < 0)
+                    return false;
+                auto width = display_width(lookahead.data(), static_cast<size_t>(n));
+                current_column += width;
+                if (n != size) {
+                    lookahead.erase(0, static_cast<size_t>(n));
+                    lookahead_width -= std::min(width, lookahead_width);
+                    return false;
+                }
+            }
+            wrapping = false;
+            breaking = false;
+            lookahead.clear();
+            lookahead_width = 0;
+            return true;
+        }
+
+        /**
+         * @brief Mark the end of a cell for the aligner, after the indentation if it starts a line.
+         * @param tab_stop the column align control code.
+         * @return false if the output was not accepted.
+         */
+        bool put_tab_stop(char_type tab_stop) {
+            if (wrapping && !flush_lookahead())
+                return false;
+            if (at_start_of_line) {
+                if (write_line(indent_level * indent_increment, nullptr, 0, prefix) < 0)
+                    return false;
+                at_start_of_line = false;
+                current_column = indent_level * indent_increment + display_width(prefix.data(), prefix.size());
+            }
+            return aligner.sputn(&tab_stop, 1) == 1;
+        }
+
+        /**
+         * @brief Write out text held after a soft break and any run of aligned lines, then synchronize the
+         * next buffer.
+         * @return -1 on failure, 0 otherwise.
+         */
+        int sync() override {
+            if (wrapping && !flush_lookahead())
+                return -1;
+            if (aligner.holding() && aligner.pubsync() != 0)
+                return -1;
+            return next->pubsync();
+        }
+
+        /**
+         * @brief Handle single characters, which arrive here because this buffer has no put area.
+         * @param c the overflow character
+         * @return EOF if the character could not be written, otherwise c as an integer.
+         */
+        int_type overflow(int_type c) override {
+            if (traits_type::eq_int_type(c, traits_type::eof()))
+                return traits_type::not_eof(c);
+
+            char_type cc = traits_type::to_char_type(c);
+            return xsputn(&cc, 1) == 1 ? c : traits_type::eof();
+        }
+
         /**
          * @brief Read data from the next buffer, filtering it before writing in this buffer.
          * @param ibuf The buffer to accept the filtered input.
@@ -154,15 +1151,20 @@ namespace fmt {
         }
     };
 
+    template<typename CharT, typename Traits, typename ControlTable>
+    class basic_scope;
+
     /**
      * @brief An output stream which uses basic_fmtstreambuf to format text.
      * @details Constructed with a std::basic_streambuf which is the ultimate destination, the stream inserts
      * a basic_fmtstreambuf which performs the formatting.
      * @tparam CharT the character type
      * @tparam Traits the character traits
+     * @tparam ControlTable the control_table mapping characters to control actions
      */
     template<typename CharT,
-            typename Traits = std::char_traits<CharT>>
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
     class basic_fmtstream : public std::basic_ostream<CharT, Traits> {
     public:
         typedef CharT char_type;
@@ -175,7 +1177,7 @@ namespace fmt {
 
         explicit basic_fmtstream(std::basic_streambuf<CharT, Traits> *next)
                 : std::basic_ostream<CharT, Traits>{next} {
-            filter = new basic_fmtstreambuf<CharT, Traits>{next};
+            filter = new basic_fmtstreambuf<CharT, Traits, ControlTable>{next};
             this->set_rdbuf(filter);
         }
 
@@ -183,8 +1185,194 @@ namespace fmt {
             delete filter;
         }
 
+        /**
+         * @brief Increase the indentation level without writing a control code.
+         */
+        basic_fmtstream &indent() {
+            filter->indent();
+            return *this;
+        }
+
+        /**
+         * @brief Decrease the indentation level without writing a control code.
+         */
+        basic_fmtstream &undent() {
+            filter->undent();
+            return *this;
+        }
+
+        basic_fmtstream &push_prefix(std::basic_string_view<CharT, Traits> line_prefix) {
+            filter->push_prefix(line_prefix);
+            return *this;
+        }
+
+        basic_fmtstream &pop_prefix() {
+            filter->pop_prefix();
+            return *this;
+        }
+
+        /**
+         * @brief Select raw text mode, in which control codes are written as text.
+         */
+        basic_fmtstream &raw_text(bool raw = true) {
+            filter->raw_text = raw;
+            return *this;
+        }
+
+        basic_fmtstreambuf<CharT, Traits, ControlTable> *formatter() {
+            return filter;
+        }
+
+        /**
+         * @brief Write a braced, indented block whose contents are written by body.
+         * @details The block is balanced, as by basic_scope, even if body throws.
+         * @param open_brace the character which opens the block.
+         * @param close_brace the character which closes the block.
+         * @param body a callable writing the contents.
+         */
+        template<typename Body>
+        basic_fmtstream &block(CharT open_brace, CharT close_brace, Body &&body) {
+            basic_scope<CharT, Traits, ControlTable> scope{*this, open_brace, close_brace};
+            std::forward<Body>(body)();
+            return *this;
+        }
+
+    protected:
+        basic_fmtstreambuf<CharT, Traits, ControlTable> *filter{nullptr};
+    };
+
+    /**
+     * @brief Indents a basic_fmtstreambuf for the lifetime of the guard.
+     * @details The indentation level is changed directly, out of band, and restored by the destructor
+     * even if the output in between leaves it unbalanced.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table of the buffer
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_indent_guard {
+    public:
+        explicit basic_indent_guard(basic_fmtstreambuf<CharT, Traits, ControlTable> &buffer, size_t levels = 1)
+                : buffer{buffer}, saved_level{buffer.state().indent_level} {
+            while (levels--)
+                buffer.indent();
+        }
+
+        explicit basic_indent_guard(basic_fmtstream<CharT, Traits, ControlTable> &stream, size_t levels = 1)
+                : basic_indent_guard{*stream.formatter(), levels} {}
+
+        ~basic_indent_guard() {
+            auto state = buffer.state();
+            state.indent_level = saved_level;
+            buffer.state(state);
+        }
+
+        basic_indent_guard(const basic_indent_guard &) = delete;
+        basic_indent_guard &operator=(const basic_indent_guard &) = delete;
+
     protected:
-        basic_fmtstreambuf<CharT, Traits> *filter{nullptr};
+        basic_fmtstreambuf<CharT, Traits, ControlTable> &buffer;
+        size_t saved_level;
+    };
+
+    /**
+     * @brief Stages the output made through a basic_fmtstreambuf during its lifetime.
+     * @details commit() writes the output, with that of any enclosing transaction, when the outermost one
+     * commits; rollback() discards it and restores the formatting state the transaction began with. A
+     * transaction destroyed without either, for example by an exception, rolls back.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table of the buffer
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_transaction {
+    public:
+        explicit basic_transaction(basic_fmtstreambuf<CharT, Traits, ControlTable> &buffer)
+                : buffer{buffer}, mark{buffer.begin_transaction()} {}
+
+        explicit basic_transaction(basic_fmtstream<CharT, Traits, ControlTable> &stream)
+                : basic_transaction{*stream.formatter()} {}
+
+        ~basic_transaction() {
+            rollback();
+        }
+
+        basic_transaction(const basic_transaction &) = delete;
+        basic_transaction &operator=(const basic_transaction &) = delete;
+
+        /**
+         * @return false if the output could not be written, or a transaction nested in this one is still open.
+         */
+        bool commit() {
+            if (!open || buffer.transaction_level() != mark.depth)
+                return false;
+            open = false;
+            return buffer.commit_transaction(mark);
+        }
+
+        void rollback() {
+            if (open) {
+                open = false;
+                buffer.rollback_transaction(mark);
+            }
+        }
+
+    protected:
+        basic_fmtstreambuf<CharT, Traits, ControlTable> &buffer;
+        typename basic_fmtstreambuf<CharT, Traits, ControlTable>::transaction_mark mark;
+        bool open{true};
+    };
+
+    /**
+     * @brief Writes a braced, indented block around the output made during its lifetime.
+     * @details The constructor writes the opening brace and an end of line and increases the indentation
+     * level; the destructor restores the indentation level it found and writes an end of line and the closing
+     * brace followed by an end of line, so the block is balanced even on exceptions or early returns. The
+     * same output as fmt::begin() and fmt::end(), without building strings.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table of the buffer
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_scope {
+    public:
+        typedef basic_fmtstreambuf<CharT, Traits, ControlTable> buffer_type;
+
+        basic_scope(basic_fmtstreambuf<CharT, Traits, ControlTable> &buffer, CharT open_brace, CharT close_brace)
+                : buffer{buffer}, saved_level{buffer.state().indent_level}, close_brace{close_brace} {
+            CharT text[] = {open_brace, buffer_type::line_break};
+            buffer.sputn(text, 1);
+            buffer.indent();
+            buffer.sputn(text + 1, 1);
+        }
+
+        basic_scope(basic_fmtstream<CharT, Traits, ControlTable> &stream, CharT open_brace, CharT close_brace)
+                : basic_scope{*stream.formatter(), open_brace, close_brace} {}
+
+        ~basic_scope() {
+            auto state = buffer.state();
+            state.indent_level = saved_level;
+            buffer.state(state);
+            CharT text[] = {buffer_type::line_break, close_brace, buffer_type::line_break};
+            try {
+                buffer.sputn(text, 3);
+            } catch (...) {
+            }
+        }
+
+        basic_scope(const basic_scope &) = delete;
+        basic_scope &operator=(const basic_scope &) = delete;
+
+    protected:
+        basic_fmtstreambuf<CharT, Traits, ControlTable> &buffer;
+        size_t saved_level;
+        CharT close_brace;
     };
 
     /**
@@ -205,6 +1393,21 @@ namespace fmt {
         return ostream << control_codes<CharT, Traits>::undent_code;
     }
 
+    template<typename CharT, typename Traits>
+    std::basic_ostream<CharT, Traits> &soft_break(std::basic_ostream<CharT, Traits> &ostream) {
+        return ostream << control_codes<CharT, Traits>::soft_break_code;
+    }
+
+    template<typename CharT, typename Traits>
+    std::basic_ostream<CharT, Traits> &tab_stop(std::basic_ostream<CharT, Traits> &ostream) {
+        return ostream << control_codes<CharT, Traits>::column_align_code;
+    }
+
+    template<typename CharT, typename Traits>
+    std::basic_ostream<CharT, Traits> &pop_prefix(std::basic_ostream<CharT, Traits> &ostream) {
+        return ostream << control_codes<CharT, Traits>::prefix_pop_code;
+    }
+
     template<typename CharT, typename Traits = std::char_traits<CharT>>
     std::basic_string<CharT, Traits> basic_begin(CharT open_brace) {
         std::basic_string<CharT, Traits> code{};
@@ -233,21 +1436,38 @@ namespace fmt {
         return code;
     }
 
-    std::string begin(char open_brace) {
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    std::basic_string<CharT, Traits> basic_push_prefix(std::basic_string_view<CharT, Traits> line_prefix) {
+        std::basic_string<CharT, Traits> code{};
+        code.push_back(control_codes<CharT, Traits>::prefix_push_code);
+        code.append(line_prefix);
+        code.push_back(control_codes<CharT, Traits>::prefix_push_code);
+        return code;
+    }
+
+    inline std::string begin(char open_brace) {
         return basic_begin<char>(open_brace);
     }
 
-    std::string end(char close_brace) {
+    inline std::string end(char close_brace) {
         return basic_end<char>(close_brace);
     }
 
-    std::string sft_end(char close_brace) {
+    inline std::string sft_end(char close_brace) {
         return basic_sft_end<char>(close_brace);
     }
 
+    inline std::string push_prefix(std::string_view line_prefix) {
+        return basic_push_prefix<char>(line_prefix);
+    }
+
     using fmtstreambuf = basic_fmtstreambuf<char>;
     using fmtstream = basic_fmtstream<char>;
 
+    using indent_guard = basic_indent_guard<char>;
+    using scope = basic_scope<char>;
+    using transaction = basic_transaction<char>;
+
     using wfmtstreambuf = basic_fmtstreambuf<wchar_t>;
     using wfmtstream = basic_fmtstream<wchar_t>;
 }
\ No newline at end of file
@@ -0,0 +1,346 @@
+//
+// Created by richard on 2019-04-02.
+//
+
+#pragma once
+
+#include <cerrno>
+#include <climits>
+#include <memory>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "streams.h"
+
+namespace exp {
+
+    /**
+     * @brief An output stream buffer which writes directly to a POSIX file descriptor.
+     * @details Small writes are collected in a buffer of configurable size. Writes larger than the
+     * buffer, and gather writes which do not fit, are passed straight to the kernel with writev(2)
+     * together with whatever is already buffered, so large spans are never copied. Works with regular
+     * files, pipes and sockets; writes to sockets do not raise SIGPIPE.
+     *
+     * With a non-blocking file descriptor a write which would block keeps whatever was not written in the
+     * buffer, fills the rest of the buffer from the output being written and returns a short count for the
+     * remainder. would_block() is then true; after poll(2) reports the descriptor writable, resume() writes the
+     * buffered characters. Nothing accepted is lost or written twice, even if the kernel takes part of a
+     * character.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_fd_streambuf : public std::basic_streambuf<CharT, Traits>, public basic_gather_sink<CharT, Traits>,
+                               public resumable_sink {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef typename Traits::int_type int_type;
+        typedef typename Traits::pos_type pos_type;
+        typedef typename Traits::off_type off_type;
+        typedef typename basic_gather_sink<CharT, Traits>::segment_type segment_type;
+
+        static constexpr size_t default_buffer_size = 4096;
+
+        basic_fd_streambuf() = delete;
+        basic_fd_streambuf(const basic_fd_streambuf &) = delete;
+        basic_fd_streambuf &operator=(const basic_fd_streambuf &) = delete;
+
+        /**
+         * @brief (constructor)
+         * @param fd the file descriptor to write to.
+         * @param buffer_size the size of the buffer in characters, 0 for an unbuffered stream.
+         * @param owns_fd if true the file descriptor is closed when the buffer is destroyed.
+         */
+        explicit basic_fd_streambuf(int fd, size_t buffer_size = default_buffer_size, bool owns_fd = false)
+                : fd{fd}, owns_fd{owns_fd}, buffer_size{buffer_size} {
+            struct stat st{};
+            is_socket = ::fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+            if (buffer_size) {
+                buffer = std::make_unique<char_type[]>(buffer_size);
+                this->setp(buffer.get(), buffer.get() + buffer_size);
+            }
+        }
+
+        /**
+         * @brief True if the last write would have blocked and buffered characters are waiting for resume().
+         */
+        bool would_block() const override {
+            return blocked;
+        }
+
+        /**
+         * @brief The number of characters buffered and not yet written.
+         */
+        size_t pending_bytes() const override {
+            return static_cast<size_t>(this->pptr() - this->pbase());
+        }
+
+        /**
+         * @brief Write the buffered characters, once the file descriptor is writable again.
+         * @return true if the buffer is empty, false if the write would still block or failed.
+         */
+        bool resume() override {
+            return sync() == 0 && !blocked;
+        }
+
+        /**
+         * @brief (destructor)
+         * @details Flush buffered output, then close the file descriptor if it is owned.
+         */
+        ~basic_fd_streambuf() override {
+            sync();
+            if (owns_fd)
+                ::close(fd);
+        }
+
+        int file_descriptor() const { return fd; }
+
+        std::streamsize gather_write(const segment_type *segments, size_t count) override {
+            size_t total = 0;
+            for (size_t idx = 0; idx < count; ++idx)
+                total += segments[idx].size();
+
+            if (total <= static_cast<size_t>(this->epptr() - this->pptr())) {
+                for (size_t idx = 0; idx < count; ++idx) {
+                    traits_type::copy(this->pptr(), segments[idx].data(), segments[idx].size());
+                    this->pbump(static_cast<int>(segments[idx].size()));
+                }
+                return static_cast<std::streamsize>(total);
+            }
+
+            if (blocked && !resume())
+                return blocked ? absorb(segments, count, 0) : 0;
+            return std::max<std::streamsize>(write_through(segments, count), 0);
+        }
+
+    protected:
+        int fd{-1};
+        bool owns_fd{false};
+        bool is_socket{false};
+        bool blocked{false};                ///< The last write would have blocked.
+        size_t buffer_size{0};
+        size_t sent{0};                     ///< Bytes of the first buffered character already written.
+        std::unique_ptr<char_type[]> buffer{};
+
+        /**
+         * @brief Copy as much of the segments as fits into the free buffer space, starting offset characters
+         * into the first segment.
+         * @return the number of characters copied.
+         */
+        std::streamsize absorb(const segment_type *segments, size_t count, size_t offset) {
+            std::streamsize copied = 0;
+            for (size_t idx = 0; idx < count && this->pptr() != this->epptr(); ++idx, offset = 0) {
+                auto size = std::min(segments[idx].size() - offset, static_cast<size_t>(this->epptr() - this->pptr()));
+                traits_type::copy(this->pptr(), segments[idx].data() + offset, size);
+                this->pbump(static_cast<int>(size));
+                copied += static_cast<std::streamsize>(size);
+            }
+            return copied;
+        }
+
+        /**
+         * @brief Account for a write which stopped after written bytes of the buffered characters followed by
+         * the segments, because it would block.
+         * @details Unwritten buffered characters are moved to the front of the buffer. A character the kernel
+         * took part of is buffered, with sent recording how much of it went, so it is never split or repeated.
+         * @return the number of characters of the segments now written or buffered.
+         */
+        std::streamsize keep_unwritten(size_t written, const segment_type *segments, size_t count) {
+            auto buffered = pending_bytes() * sizeof(char_type) - sent;
+            if (written < buffered) {
+                auto done = (sent + written) / sizeof(char_type);
+                sent = (sent + written) % sizeof(char_type);
+                auto left = pending_bytes() - done;
+                traits_type::move(buffer.get(), this->pbase() + done, left);
+                this->setp(buffer.get(), buffer.get() + buffer_size);
+                this->pbump(static_cast<int>(left));
+                return absorb(segments, count, 0);
+            }
+
+            this->setp(buffer.get(), buffer.get() + buffer_size);
+            written -= buffered;
+            sent = 0;
+            std::streamsize consumed = 0;
+            size_t idx = 0;
+            for (; idx < count && written >= segments[idx].size() * sizeof(char_type); ++idx) {
+                written -= segments[idx].size() * sizeof(char_type);
+                consumed += static_cast<std::streamsize>(segments[idx].size());
+            }
+            if (idx == count)
+                return consumed;
+            auto offset = written / sizeof(char_type);
+            consumed += static_cast<std::streamsize>(offset);
+            if (written % sizeof(char_type) && buffer_size) {
+                sent = written % sizeof(char_type);
+                *this->pptr() = segments[idx][offset++];
+                this->pbump(1);
+                ++consumed;
+            }
+            if (offset == segments[idx].size()) {
+                ++idx;
+                offset = 0;
+            }
+            return consumed + absorb(segments + idx, count - idx, offset);
+        }
+
+        /**
+         * @brief Write the buffered characters followed by the given segments, retrying until all have
+         * been written, the write would block or an error occurs.
+         * @return the number of characters of the segments written or buffered, which is short on error, or -1
+         * if an error occurred before any of them were written.
+         */
+        std::streamsize write_through(const segment_type *segments, size_t count) {
+            iovec iov[IOV_MAX > 64 ? 64 : IOV_MAX];
+            constexpr size_t iov_max = sizeof(iov) / sizeof(iov[0]);
+            size_t next_segment = 0;
+            size_t used = 0;
+            size_t bytes = 0;
+            std::streamsize consumed = 0;
+
+            blocked = false;
+            if (this->pptr() != this->pbase()) {
+                iov[used].iov_base = reinterpret_cast<char *>(this->pbase()) + sent;
+                iov[used].iov_len = pending_bytes() * sizeof(char_type) - sent;
+                bytes += iov[used++].iov_len;
+            }
+
+            do {
+                auto first_segment = next_segment;
+                for (; next_segment < count && used < iov_max; ++next_segment) {
+                    if (segments[next_segment].empty())
+                        continue;
+                    iov[used].iov_base = const_cast<char_type *>(segments[next_segment].data());
+                    iov[used].iov_len = segments[next_segment].size() * sizeof(char_type);
+                    bytes += iov[used++].iov_len;
+                }
+                auto written = write_all(iov, used);
+                if (written < 0)
+                    return consumed ? consumed : -1;
+                if (static_cast<size_t>(written) < bytes) {
+                    blocked = true;
+                    return consumed + keep_unwritten(static_cast<size_t>(written), segments + first_segment,
+                                                     count - first_segment);
+                }
+                if (buffer)
+                    this->setp(buffer.get(), buffer.get() + buffer_size);
+                sent = 0;
+                for (auto idx = first_segment; idx < next_segment; ++idx)
+                    consumed += static_cast<std::streamsize>(segments[idx].size());
+                used = 0;
+                bytes = 0;
+            } while (next_segment < count);
+
+            return consumed;
+        }
+
+        /**
+         * @brief Write an I/O vector, advancing over partial writes, until it is all written or the write
+         * would block.
+         * @return the number of bytes written, -1 on error.
+         */
+        ssize_t write_all(iovec *iov, size_t count) {
+            ssize_t total = 0;
+            while (count) {
+                ssize_t n;
+                if (is_socket) {
+                    msghdr msg{};
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = count;
+                    n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+                } else {
+                    n = ::writev(fd, iov, static_cast<int>(count));
+                }
+
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return total;
+                    return -1;
+                }
+
+                total += n;
+                auto written = static_cast<size_t>(n);
+                while (count && written >= iov->iov_len) {
+                    written -= iov->iov_len;
+                    ++iov;
+                    --count;
+                }
+                if (count) {
+                    iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                    iov->iov_len -= written;
+                }
+            }
+            return total;
+        }
+
+        /**
+         * @brief Write the buffered characters to the file descriptor.
+         * @details If the write would block the rest stays buffered and would_block() is true.
+         * @return -1 on failure, 0 otherwise.
+         */
+        int sync() override {
+            if (this->pptr() == this->pbase()) {
+                blocked = false;
+                return 0;
+            }
+            return write_through(nullptr, 0) < 0 ? -1 : 0;
+        }
+
+        /**
+         * @brief Handle overflow characters
+         * @param c the overflow character
+         * @return EOF if the write fails, otherwise c as an integer.
+         */
+        int_type overflow(int_type c) override {
+            if (traits_type::eq_int_type(c, traits_type::eof()))
+                return sync() < 0 ? traits_type::eof() : traits_type::not_eof(c);
+
+            char_type cc = traits_type::to_char_type(c);
+            return xsputn(&cc, 1) == 1 ? c : traits_type::eof();
+        }
+
+        /**
+         * @brief Write a span of characters.
+         * @details Spans which fit in the remaining buffer space are copied. Anything larger than the
+         * whole buffer is written directly, together with the buffered characters, in one writev(2).
+         * While the file descriptor would block only what fits in the buffer is accepted.
+         * @return the number of characters written or buffered, short on error.
+         */
+        std::streamsize xsputn(const char_type *s, std::streamsize count) override {
+            auto room = this->epptr() - this->pptr();
+            if (count <= room) {
+                traits_type::copy(this->pptr(), s, static_cast<size_t>(count));
+                this->pbump(static_cast<int>(count));
+                return count;
+            }
+
+            segment_type segment{s, static_cast<size_t>(count)};
+            if (blocked && !resume())
+                return blocked ? absorb(&segment, 1, 0) : 0;
+
+            room = this->epptr() - this->pptr();
+            if (count <= room) {
+                traits_type::copy(this->pptr(), s, static_cast<size_t>(count));
+                this->pbump(static_cast<int>(count));
+                return count;
+            }
+            if (static_cast<size_t>(count) < buffer_size) {
+                traits_type::copy(this->pptr(), s, static_cast<size_t>(room));
+                this->pbump(static_cast<int>(room));
+                if (sync() < 0)
+                    return room;
+                segment = segment_type{s + room, static_cast<size_t>(count - room)};
+                return room + absorb(&segment, 1, 0);
+            }
+
+            return std::max<std::streamsize>(write_through(&segment, 1), 0);
+        }
+    };
+
+    using fd_streambuf = basic_fd_streambuf<char>;
+}
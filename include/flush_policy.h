@@ -0,0 +1,143 @@
+//
+// Created by richard on 2019-04-27.
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// GCC declares exp() as a built-in function and warns about anything else with that name.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbuiltin-declaration-mismatch"
+#endif
+namespace exp {
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+    /**
+     * @brief When a basic_filter_streambuf flushes its output through the chain.
+     */
+    enum class flush_trigger {
+        when_full,  ///< Only when the buffer fills (without syncing the next buffer), on sync() and on close.
+        bytes,      ///< Whenever flush_policy::bytes characters have been written since the last flush.
+        newline,    ///< At the end of every write containing a newline, through the last newline.
+        deadline,   ///< No later than flush_policy::max_latency after the first character written since a flush.
+        close,      ///< Never until close() or destruction; sync() is ignored, full buffers are passed on.
+    };
+
+    /**
+     * @brief The flush policy of a basic_filter_streambuf.
+     */
+    struct flush_policy {
+        flush_trigger trigger{flush_trigger::when_full};
+        size_t bytes{0};                                ///< The flush interval for flush_trigger::bytes.
+        std::chrono::microseconds max_latency{0};       ///< The deadline for flush_trigger::deadline.
+    };
+
+    namespace detail {
+
+        /**
+         * @brief Something the flush_timer flushes when its deadline passes.
+         */
+        class deadline_flushable {
+        public:
+            virtual ~deadline_flushable() = default;
+
+            /**
+             * @brief Called on the timer thread once the deadline has passed.
+             */
+            virtual void deadline_flush() = 0;
+        };
+
+        /**
+         * @brief The timer thread shared by all streams with flush_trigger::deadline.
+         * @details Each target has at most one deadline. A target is flushed on the timer thread without the
+         * timer's lock held, so it may schedule again from deadline_flush(); cancel() waits for a flush of the
+         * target in progress. The timer is never destroyed, so streams with static storage duration may use it.
+         */
+        class flush_timer {
+        public:
+            typedef std::chrono::steady_clock clock_type;
+
+            static flush_timer &instance() {
+                static auto timer = new flush_timer{};
+                return *timer;
+            }
+
+            /**
+             * @brief Flush target at deadline, unless it already has an earlier deadline.
+             */
+            void schedule(deadline_flushable *target, clock_type::time_point deadline) {
+                std::lock_guard<std::mutex> lock{mutex};
+                auto found = targets.find(target);
+                if (found != targets.end()) {
+                    if (found->second->first <= deadline)
+                        return;
+                    deadlines.erase(found->second);
+                    targets.erase(found);
+                }
+                auto entry = deadlines.emplace(deadline, target);
+                targets.emplace(target, entry);
+                if (entry == deadlines.begin())
+                    cv.notify_all();
+            }
+
+            /**
+             * @brief Remove the deadline of target and wait for a flush of it in progress to finish.
+             */
+            void cancel(deadline_flushable *target) {
+                std::unique_lock<std::mutex> lock{mutex};
+                auto found = targets.find(target);
+                if (found != targets.end()) {
+                    deadlines.erase(found->second);
+                    targets.erase(found);
+                }
+                cv.wait(lock, [&] { return in_flight != target; });
+            }
+
+        protected:
+            std::mutex mutex{};
+            std::condition_variable cv{};
+            std::multimap<clock_type::time_point, deadline_flushable *> deadlines{};
+            std::unordered_map<deadline_flushable *, decltype(deadlines)::iterator> targets{};
+            deadline_flushable *in_flight{nullptr};
+
+            flush_timer() {
+                std::thread{[this] { run(); }}.detach();
+            }
+
+            void run() {
+                std::unique_lock<std::mutex> lock{mutex};
+                while (true) {
+                    if (deadlines.empty()) {
+                        cv.wait(lock);
+                        continue;
+                    }
+                    auto first = deadlines.begin();
+                    auto deadline = first->first;
+                    if (deadline > clock_type::now()) {
+                        cv.wait_until(lock, deadline);
+                        continue;
+                    }
+                    auto target = first->second;
+                    in_flight = target;
+                    targets.erase(target);
+                    deadlines.erase(first);
+                    lock.unlock();
+                    target->deadline_flush();
+                    lock.lock();
+                    in_flight = nullptr;
+                    cv.notify_all();
+                }
+            }
+        };
+    }
+}
@@ -0,0 +1,200 @@
+//
+// Created by richard on 2019-04-15.
+//
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "code_fmt_stream.h"
+
+namespace fmt {
+
+    namespace detail {
+
+        /**
+         * @brief The effect of one chunk of input on the formatting state.
+         * @details Because undent stops at level zero the indent level after a chunk is
+         * max(level + delta, floor) of the level before it; functions of this form compose.
+         * at_start_after[s] is the start of line state after the chunk given state s before it.
+         */
+        struct chunk_summary {
+            long delta{0};
+            long floor{0};
+            bool at_start_after[2]{false, true};
+            bool prefix_codes{false};
+        };
+
+        template<typename CharT, typename Traits, typename ControlTable>
+        chunk_summary summarize_chunk(std::basic_string_view<CharT, Traits> chunk, const std::ctype<CharT> &ctype,
+                                      bool raw_text) {
+            chunk_summary summary{};
+            for (auto c : chunk) {
+                auto action = ControlTable::template action<CharT, Traits>(c);
+                if (raw_text && action != control_action::end_of_line)
+                    action = control_action::text;
+                if (action == control_action::indent) {
+                    ++summary.delta;
+                    ++summary.floor;
+                    continue;
+                }
+                if (action == control_action::undent) {
+                    --summary.delta;
+                    summary.floor = std::max(summary.floor - 1, 0L);
+                    continue;
+                }
+                if (action == control_action::prefix_push || action == control_action::prefix_pop)
+                    summary.prefix_codes = true;
+                if (action != control_action::text && action != control_action::end_of_line)
+                    continue;
+                bool space = ctype.is(std::ctype_base::space, c);
+                bool end_of_line = action == control_action::end_of_line;
+                for (auto &at_start : summary.at_start_after)
+                    if (!(at_start && space))
+                        at_start = end_of_line;
+            }
+            return summary;
+        }
+
+        /**
+         * @brief Run body(index) for every index below count on up to thread_count threads.
+         */
+        template<typename Body>
+        void parallel_for(size_t count, size_t thread_count, Body body) {
+            std::atomic<size_t> next_index{0};
+            auto worker = [&] {
+                for (auto idx = next_index++; idx < count; idx = next_index++)
+                    body(idx);
+            };
+
+            std::vector<std::thread> threads{};
+            for (size_t t = 1; t < std::min(thread_count, count); ++t)
+                threads.emplace_back(worker);
+            worker();
+            for (auto &thread : threads)
+                thread.join();
+        }
+    }
+
+    /**
+     * @brief Format a large buffer of text and control codes on several threads.
+     * @details The output is identical to writing input to formatter. The input is split into chunks; the net
+     * effect of each chunk on the indent level and start of line state is computed in parallel, combined by a
+     * prefix scan so every chunk knows the state it starts in, and then every chunk is formatted concurrently
+     * into its own buffer. The buffers are written to the formatter's next buffer in one gather write and the
+     * formatter is left in the state following the input. Chunks are formatted by plain basic_fmtstreambuf
+     * instances, so control_action::user codes do not reach an overridden control(). Wrapping at soft breaks
+     * depends on the column each chunk starts at, and tab stops on the lines around it, so a formatter with a
+     * line_width or align_columns set formats sequentially, as does input which pushes or pops line prefixes.
+     * @param input the text and control codes to format.
+     * @param formatter the formatter whose state, indent increment and next buffer are used.
+     * @param thread_count the number of threads to use.
+     * @param min_chunk_size inputs shorter than this are formatted directly.
+     * @return the number of characters of input consumed, or -1 if the next buffer did not accept the output.
+     */
+    template<typename CharT, typename Traits, typename ControlTable>
+    std::streamsize format_parallel(std::basic_string_view<CharT, Traits> input,
+                                    basic_fmtstreambuf<CharT, Traits, ControlTable> &formatter,
+                                    size_t thread_count = std::thread::hardware_concurrency(),
+                                    size_t min_chunk_size = 256 * 1024) {
+        thread_count = std::max<size_t>(thread_count, 1);
+        if (thread_count == 1 || input.size() < min_chunk_size || formatter.line_width || formatter.align_columns)
+            return formatter.sputn(input.data(), static_cast<std::streamsize>(input.size()));
+
+        // Indentation and line prefix left pending from earlier output go first; the chunks start without them.
+        if (formatter.sputn(input.data(), 0) != 0 || formatter.would_block())
+            return -1;
+
+        auto chunk_count = std::min(thread_count * 4, input.size() / std::max<size_t>(min_chunk_size / 4, 1) + 1);
+        auto chunk_size = (input.size() + chunk_count - 1) / chunk_count;
+        std::vector<std::basic_string_view<CharT, Traits>> chunks{};
+        for (size_t offset = 0; offset < input.size(); offset += chunk_size)
+            chunks.push_back(input.substr(offset, chunk_size));
+
+        std::locale locale{};
+        auto &ctype = std::use_facet<std::ctype<CharT>>(locale);
+        std::vector<detail::chunk_summary> summaries(chunks.size());
+        detail::parallel_for(chunks.size(), thread_count, [&](size_t idx) {
+            summaries[idx] = detail::summarize_chunk<CharT, Traits, ControlTable>(chunks[idx], ctype, formatter.raw_text);
+        });
+
+        for (auto &summary : summaries)
+            if (summary.prefix_codes)
+                return formatter.sputn(input.data(), static_cast<std::streamsize>(input.size()));
+
+        typedef typename basic_fmtstreambuf<CharT, Traits, ControlTable>::state_type state_type;
+        std::vector<state_type> starts(chunks.size() + 1);
+        starts[0] = formatter.state();
+        for (size_t idx = 0; idx < chunks.size(); ++idx) {
+            auto level = static_cast<long>(starts[idx].indent_level);
+            starts[idx + 1].indent_level = static_cast<size_t>(
+                    std::max(level + summaries[idx].delta, summaries[idx].floor));
+            starts[idx + 1].at_start_of_line = summaries[idx].at_start_after[starts[idx].at_start_of_line];
+        }
+
+        std::vector<detail::basic_string_sink<CharT, Traits>> outputs(chunks.size());
+        detail::parallel_for(chunks.size(), thread_count, [&](size_t idx) {
+            outputs[idx].text.reserve(chunks[idx].size() + chunks[idx].size() / 4);
+            basic_fmtstreambuf<CharT, Traits, ControlTable> chunk_formatter{&outputs[idx]};
+            chunk_formatter.indent_increment = formatter.indent_increment;
+            chunk_formatter.keep_blank_lines = formatter.keep_blank_lines;
+            chunk_formatter.raw_text = formatter.raw_text;
+            if (!formatter.line_prefix().empty())
+                chunk_formatter.push_prefix(formatter.line_prefix());
+            chunk_formatter.state(starts[idx]);
+            chunk_formatter.sputn(chunks[idx].data(), static_cast<std::streamsize>(chunks[idx].size()));
+        });
+
+        std::vector<std::basic_string_view<CharT, Traits>> segments{};
+        std::streamsize total = 0;
+        for (auto &output : outputs) {
+            segments.emplace_back(output.text);
+            total += static_cast<std::streamsize>(output.text.size());
+        }
+        auto next = formatter.next_buffer();
+        if (io::sputv(next, segments.data(), segments.size()) != total)
+            return -1;
+
+        // The column follows the last end of line written, or advances from where it was.
+        auto final_state = starts.back();
+        final_state.column = starts[0].column;
+        for (auto output = outputs.rbegin(); output != outputs.rend(); ++output) {
+            auto &text = output->text;
+            auto line_start = text.size();
+            while (line_start &&
+                   ControlTable::template action<CharT, Traits>(text[line_start - 1]) != control_action::end_of_line)
+                --line_start;
+            if (!line_start) {
+                final_state.column += formatter.display_width(text.data(), text.size());
+                continue;
+            }
+            final_state.column = formatter.display_width(text.data() + line_start, text.size() - line_start);
+            for (auto later = output.base(); later != outputs.end(); ++later)
+                final_state.column += formatter.display_width(later->text.data(), later->text.size());
+            break;
+        }
+        formatter.state(final_state);
+        return static_cast<std::streamsize>(input.size());
+    }
+
+    /**
+     * @brief Format a large buffer of text and control codes on several threads, starting at the left margin.
+     * @param input the text and control codes to format.
+     * @param sink the destination buffer.
+     * @param thread_count the number of threads to use.
+     * @param indent_increment spaces per indent level.
+     * @return the number of characters of input consumed, or -1 if sink did not accept the output.
+     */
+    template<typename CharT, typename Traits>
+    std::streamsize format_parallel(std::basic_string_view<CharT, Traits> input,
+                                    std::basic_streambuf<CharT, Traits> *sink,
+                                    size_t thread_count = std::thread::hardware_concurrency(),
+                                    size_t indent_increment = 4) {
+        basic_fmtstreambuf<CharT, Traits> formatter{sink};
+        formatter.indent_increment = indent_increment;
+        return format_parallel(input, formatter, thread_count);
+    }
+}
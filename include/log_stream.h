@@ -0,0 +1,376 @@
+//
+// Created by richard on 2019-04-10.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include "streams.h"
+
+namespace exp {
+
+    namespace detail {
+
+        /**
+         * @brief A completed log record, allocated with its character storage inline.
+         */
+        template<typename CharT>
+        struct log_record {
+            std::atomic<log_record *> next{nullptr};
+            size_t size{0};
+            size_t capacity{0};
+
+            CharT *data() { return reinterpret_cast<CharT *>(this + 1); }
+
+            static log_record *create(size_t capacity) {
+                auto record = new(::operator new(sizeof(log_record) + capacity * sizeof(CharT))) log_record{};
+                record->capacity = capacity;
+                return record;
+            }
+
+            static void destroy(log_record *record) {
+                record->~log_record();
+                ::operator delete(record);
+            }
+        };
+
+        /**
+         * @brief An unbounded lock-free multi-producer single-consumer queue of log records.
+         * @details The intrusive queue of D. Vyukov: a push is one atomic exchange and one store, and records
+         * are popped in the order their exchanges took place, so the records of any one producer stay in order.
+         * Once the queue is closed pushes are refused; pushes in progress are counted so the consumer can tell
+         * when the last of them has been published.
+         */
+        template<typename CharT>
+        class log_queue {
+        public:
+            typedef log_record<CharT> record_type;
+
+            log_queue() : head{&stub}, tail{&stub} {}
+
+            ~log_queue() {
+                while (auto record = pop())
+                    record_type::destroy(record);
+            }
+
+            /**
+             * @brief Publish a record.
+             * @return false, leaving the record with the caller, if the queue is closed.
+             */
+            bool push(record_type *record) {
+                pushing.fetch_add(1, std::memory_order_seq_cst);
+                if (closed.load(std::memory_order_seq_cst)) {
+                    pushing.fetch_sub(1, std::memory_order_release);
+                    return false;
+                }
+                record->next.store(nullptr, std::memory_order_relaxed);
+                auto prev = head.exchange(record, std::memory_order_acq_rel);
+                prev->next.store(record, std::memory_order_release);
+                pushing.fetch_sub(1, std::memory_order_release);
+
+                // Pairs with the fence in wait() so a sleeping consumer is always woken; only the first push
+                // to find it waiting takes the lock.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (consumer_waiting.load(std::memory_order_relaxed) &&
+                    consumer_waiting.exchange(false, std::memory_order_relaxed)) {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    cv.notify_one();
+                }
+                return true;
+            }
+
+            /**
+             * @brief Refuse further pushes.
+             */
+            void close() {
+                closed.store(true, std::memory_order_seq_cst);
+            }
+
+            bool is_closed() const {
+                return closed.load(std::memory_order_acquire);
+            }
+
+            /**
+             * @brief True once the queue is closed and no push is still publishing a record, so that pop()
+             * returns every record which will ever be pushed.
+             */
+            bool settled() const {
+                return closed.load(std::memory_order_seq_cst) && !pushing.load(std::memory_order_seq_cst);
+            }
+
+            /**
+             * @brief Pop the oldest record, consumer thread only.
+             * @return the record, or nullptr if the queue is empty or a push is still in progress.
+             */
+            record_type *pop() {
+                auto first = tail;
+                auto next = first->next.load(std::memory_order_acquire);
+                if (first == &stub) {
+                    if (!next)
+                        return nullptr;
+                    tail = next;
+                    first = next;
+                    next = next->next.load(std::memory_order_acquire);
+                }
+                if (next) {
+                    tail = next;
+                    return first;
+                }
+                if (first != head.load(std::memory_order_acquire))
+                    return nullptr;
+                push_stub();
+                next = first->next.load(std::memory_order_acquire);
+                if (next) {
+                    tail = next;
+                    return first;
+                }
+                return nullptr;
+            }
+
+            /**
+             * @brief Block the consumer until a record may be available or stop is set.
+             * @details The consumer sleeps without a timeout: a push which finds it waiting wakes it, and
+             * wake() is called after stop is set.
+             */
+            void wait(const std::atomic<bool> &stop) {
+                std::unique_lock<std::mutex> lock{mutex};
+                consumer_waiting.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!ready() && !stop.load())
+                    cv.wait(lock);
+                consumer_waiting.store(false, std::memory_order_relaxed);
+            }
+
+            void wake() {
+                std::lock_guard<std::mutex> lock{mutex};
+                cv.notify_one();
+            }
+
+        protected:
+            std::atomic<record_type *> head;
+            record_type *tail;
+            record_type stub{};
+            std::atomic<bool> consumer_waiting{false};
+            std::atomic<bool> closed{false};
+            std::atomic<size_t> pushing{0};
+            std::mutex mutex{};
+            std::condition_variable cv{};
+
+            bool ready() const {
+                return tail->next.load(std::memory_order_acquire) != nullptr ||
+                       (tail != &stub && head.load(std::memory_order_acquire) == tail);
+            }
+
+            void push_stub() {
+                stub.next.store(nullptr, std::memory_order_relaxed);
+                auto prev = head.exchange(&stub, std::memory_order_acq_rel);
+                prev->next.store(&stub, std::memory_order_release);
+            }
+        };
+    }
+
+    template<typename CharT, typename Traits>
+    class basic_log_ostream;
+
+    /**
+     * @brief The shared back end of a multi-producer log stream.
+     * @details Producers write through their own basic_log_ostream front end; each completed record is
+     * published to a lock-free queue which a single consumer thread drains into the destination buffer,
+     * normally the head of a filter chain. Records from one thread arrive in the order they were written.
+     * The destination is synchronized whenever the queue has been emptied.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_log_sink {
+    public:
+        typedef detail::log_queue<CharT> queue_type;
+
+        basic_log_sink() = delete;
+        basic_log_sink(const basic_log_sink &) = delete;
+        basic_log_sink &operator=(const basic_log_sink &) = delete;
+
+        /**
+         * @brief (constructor)
+         * @param next the destination buffer, written only by the consumer thread.
+         */
+        explicit basic_log_sink(std::basic_streambuf<CharT, Traits> *next)
+                : next{next}, queue{std::make_shared<queue_type>()}, consumer{[this] { run(); }} {}
+
+        /**
+         * @brief (destructor)
+         * @details Closes the queue, drains every record published so far, then stops the consumer. Front ends
+         * which outlive the sink stay safe to use but their records are discarded; a thread's front ends of
+         * destroyed sinks are freed the next time it creates a front end.
+         */
+        ~basic_log_sink() {
+            queue->close();
+            stop.store(true);
+            queue->wake();
+            consumer.join();
+        }
+
+        /**
+         * @brief The calling thread's front end for this sink, created on first use.
+         */
+        basic_log_ostream<CharT, Traits> &local() {
+            struct front_end {
+                std::shared_ptr<queue_type> queue;
+                std::unique_ptr<basic_log_ostream<CharT, Traits>> stream;
+            };
+            thread_local std::unordered_map<std::uint64_t, front_end> streams{};
+
+            auto found = streams.find(generation);
+            if (found != streams.end())
+                return *found->second.stream;
+            for (auto entry = streams.begin(); entry != streams.end();)
+                entry = entry->second.queue->is_closed() ? streams.erase(entry) : std::next(entry);
+            auto &entry = streams[generation];
+            entry.queue = queue;
+            entry.stream = std::make_unique<basic_log_ostream<CharT, Traits>>(*this);
+            return *entry.stream;
+        }
+
+    protected:
+        friend class basic_log_ostream<CharT, Traits>;
+
+        std::basic_streambuf<CharT, Traits> *next;
+        std::shared_ptr<queue_type> queue;
+        std::uint64_t generation{next_generation()};     ///< Distinguishes this sink from any other, past or future.
+        std::atomic<bool> stop{false};
+        std::thread consumer;
+
+        static std::uint64_t next_generation() {
+            static std::atomic<std::uint64_t> generations{0};
+            return ++generations;
+        }
+
+        void run() {
+            while (true) {
+                bool stopping = stop.load() && queue->settled();
+                bool wrote = false;
+                while (auto record = queue->pop()) {
+                    next->sputn(record->data(), static_cast<std::streamsize>(record->size));
+                    queue_type::record_type::destroy(record);
+                    wrote = true;
+                }
+                if (wrote)
+                    next->pubsync();
+                else if (stopping)
+                    return;
+                else
+                    queue->wait(stop);
+            }
+        }
+    };
+
+    /**
+     * @brief A per-thread stream buffer which collects one log record and publishes it on sync().
+     * @details The put area is the record's own storage, so publishing a record costs one queue push and
+     * one allocation for the next record; nothing is copied.
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_log_streambuf : public std::basic_streambuf<CharT, Traits> {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef typename Traits::int_type int_type;
+        typedef detail::log_queue<CharT> queue_type;
+        typedef typename queue_type::record_type record_type;
+
+        static constexpr size_t initial_capacity = 256;
+
+        basic_log_streambuf() = delete;
+
+        explicit basic_log_streambuf(std::shared_ptr<queue_type> queue) : queue{std::move(queue)} {
+            start_record(initial_capacity);
+        }
+
+        /**
+         * @brief (destructor)
+         * @details Publish any partial record.
+         */
+        ~basic_log_streambuf() override {
+            sync();
+            record_type::destroy(record);
+        }
+
+    protected:
+        std::shared_ptr<queue_type> queue;
+        record_type *record{nullptr};
+
+        void start_record(size_t capacity) {
+            record = record_type::create(capacity);
+            this->setp(record->data(), record->data() + capacity);
+        }
+
+        /**
+         * @brief Publish the record collected so far, or discard it if the sink has been destroyed.
+         * @return 0.
+         */
+        int sync() override {
+            if (this->pptr() == this->pbase())
+                return 0;
+            record->size = static_cast<size_t>(this->pptr() - this->pbase());
+            if (!queue->push(record)) {
+                this->setp(record->data(), record->data() + record->capacity);
+                return 0;
+            }
+            start_record(initial_capacity);
+            return 0;
+        }
+
+        /**
+         * @brief Grow the record when it is full.
+         * @param c the overflow character
+         * @return c as an integer.
+         */
+        int_type overflow(int_type c) override {
+            auto size = static_cast<size_t>(this->pptr() - this->pbase());
+            auto grown = record_type::create(record->capacity * 2);
+            traits_type::copy(grown->data(), record->data(), size);
+            record_type::destroy(record);
+            record = grown;
+            this->setp(record->data(), record->data() + record->capacity);
+            this->pbump(static_cast<int>(size));
+
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *this->pptr() = traits_type::to_char_type(c);
+                this->pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+    };
+
+    /**
+     * @brief A per-thread front end of a basic_log_sink.
+     * @details Each flush (std::endl, std::flush) publishes what has been written since the previous flush as
+     * one record. A front end must only be used by one thread at a time; basic_log_sink::local() returns one
+     * for the calling thread.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_log_ostream : public std::basic_ostream<CharT, Traits> {
+    public:
+        basic_log_ostream() = delete;
+
+        explicit basic_log_ostream(basic_log_sink<CharT, Traits> &sink)
+                : std::basic_ostream<CharT, Traits>{nullptr}, buffer{sink.queue} {
+            this->rdbuf(&buffer);
+        }
+
+    protected:
+        basic_log_streambuf<CharT, Traits> buffer;
+    };
+
+    using log_sink = basic_log_sink<char>;
+    using log_ostream = basic_log_ostream<char>;
+}
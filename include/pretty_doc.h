@@ -0,0 +1,265 @@
+//
+// Created by richard on 2019-04-19.
+//
+
+#pragma once
+
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "code_fmt_stream.h"
+
+namespace fmt {
+
+    /**
+     * @brief The kinds of document node.
+     */
+    enum class doc_kind : unsigned char {
+        text,       ///< A run of text with no line ends.
+        line,       ///< A space when its group is flat, otherwise a line break.
+        softline,   ///< Nothing when its group is flat, otherwise a line break.
+        concat,     ///< A sequence of documents.
+        nest,       ///< A document whose line breaks are indented further.
+        group,      ///< A document laid out flat if it fits, otherwise broken.
+    };
+
+    /**
+     * @brief A pretty printing document in the style of Wadler's "prettier printer".
+     * @details Documents are built bottom up from text, line, softline, concat, nest and group; every node lives
+     * in the document's arena and is referred to by an id, so building a document costs no allocation per node
+     * once the arena has grown. render() lays a document out through a basic_fmtstreambuf: each group is printed
+     * either entirely flat, its lines as spaces, or entirely broken, its lines as line ends. Nesting is applied
+     * with the formatter's own indent levels so the document lines up with the surrounding output.
+     *
+     * The flat width of every node is computed when it is built, so deciding whether a group fits looks at most
+     * at the remaining width of the line: layout is linear in the size of the document for a given width.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>>
+    class basic_doc {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef std::basic_string_view<CharT, Traits> string_view_type;
+        typedef size_t id_type;
+
+        /**
+         * @brief Text which must not contain line ends or control codes.
+         */
+        id_type text(string_view_type value) {
+            auto first = text_arena.size();
+            text_arena.append(value);
+            return add(doc_kind::text, first, value.size(),
+                       basic_fmtstreambuf<CharT, Traits>::display_width(value.data(), value.size()));
+        }
+
+        id_type line() {
+            return add(doc_kind::line, 0, 0, 1);
+        }
+
+        id_type softline() {
+            return add(doc_kind::softline, 0, 0, 0);
+        }
+
+        id_type concat(std::initializer_list<id_type> parts) {
+            return concat(parts.begin(), parts.size());
+        }
+
+        id_type concat(const id_type *parts, size_t count) {
+            auto first = children.size();
+            size_t flat_width = 0;
+            for (size_t idx = 0; idx < count; ++idx) {
+                children.push_back(parts[idx]);
+                flat_width += nodes[parts[idx]].flat_width;
+            }
+            return add(doc_kind::concat, first, count, flat_width);
+        }
+
+        /**
+         * @brief Indent line breaks within body by levels indent levels.
+         */
+        id_type nest(size_t levels, id_type body) {
+            return add(doc_kind::nest, body, levels, nodes[body].flat_width);
+        }
+
+        id_type group(id_type body) {
+            return add(doc_kind::group, body, 0, nodes[body].flat_width);
+        }
+
+        /**
+         * @brief The width of a node laid out flat.
+         */
+        size_t flat_width(id_type id) const {
+            return nodes[id].flat_width;
+        }
+
+        /**
+         * @brief Discard every node, keeping the arena's storage.
+         */
+        void clear() {
+            nodes.clear();
+            children.clear();
+            text_arena.clear();
+        }
+
+        /**
+         * @brief Lay out a document through formatter.
+         * @details Layout starts at the formatter's current column and indent level.
+         * @param formatter the formatter to write to.
+         * @param root the document.
+         * @param width the line width; 0 uses the formatter's line_width, or 80 if that is not set.
+         * @return false if the formatter did not accept the output.
+         */
+        template<typename ControlTable>
+        bool render(basic_fmtstreambuf<CharT, Traits, ControlTable> &formatter, id_type root, size_t width = 0) {
+            if (!width)
+                width = formatter.line_width ? formatter.line_width : 80;
+            char_type end_of_line = basic_fmtstreambuf<CharT, Traits, ControlTable>::line_break;
+            char_type space = std::use_facet<std::ctype<char_type>>(formatter.getloc()).widen(' ');
+
+            frames.clear();
+            frames.push_back(frame{root, false, false});
+            while (!frames.empty()) {
+                auto current = frames.back();
+                frames.pop_back();
+                auto &node = nodes[current.id];
+                if (current.undent) {
+                    for (size_t level = 0; level < node.count; ++level)
+                        formatter.undent();
+                    continue;
+                }
+
+                switch (node.kind) {
+                    case doc_kind::text:
+                        if (node.count && formatter.sputn(text_arena.data() + node.first,
+                                                          static_cast<std::streamsize>(node.count)) !=
+                                          static_cast<std::streamsize>(node.count))
+                            return false;
+                        break;
+                    case doc_kind::line:
+                        if (formatter.sputn(current.flat ? &space : &end_of_line, 1) != 1)
+                            return false;
+                        break;
+                    case doc_kind::softline:
+                        if (!current.flat && formatter.sputn(&end_of_line, 1) != 1)
+                            return false;
+                        break;
+                    case doc_kind::concat:
+                        for (auto idx = node.first + node.count; idx > node.first; --idx)
+                            frames.push_back(frame{children[idx - 1], current.flat, false});
+                        break;
+                    case doc_kind::nest:
+                        if (current.flat) {
+                            frames.push_back(frame{node.first, true, false});
+                            break;
+                        }
+                        for (size_t level = 0; level < node.count; ++level)
+                            formatter.indent();
+                        frames.push_back(frame{current.id, false, true});
+                        frames.push_back(frame{node.first, false, false});
+                        break;
+                    case doc_kind::group: {
+                        auto column = current_column(formatter);
+                        bool flat = current.flat || (column <= width && fits(node.first, width - column));
+                        frames.push_back(frame{node.first, flat, false});
+                        break;
+                    }
+                }
+            }
+            return true;
+        }
+
+    protected:
+        struct node_type {
+            doc_kind kind;
+            size_t first;       ///< Text offset, first child index, or body id.
+            size_t count;       ///< Text length, child count, or nest levels.
+            size_t flat_width;
+        };
+
+        struct frame {
+            id_type id;
+            bool flat;
+            bool undent;        ///< Leaving a nest node.
+        };
+
+        std::vector<node_type> nodes{};
+        std::vector<id_type> children{};
+        std::basic_string<CharT, Traits> text_arena{};
+        std::vector<frame> frames{};
+        std::vector<frame> lookahead{};
+
+        id_type add(doc_kind kind, size_t first, size_t count, size_t flat_width) {
+            nodes.push_back(node_type{kind, first, count, flat_width});
+            return nodes.size() - 1;
+        }
+
+        /**
+         * @brief The column the next text will be written at; at the start of a line that follows the
+         * indentation and the line prefix.
+         */
+        template<typename ControlTable>
+        static size_t current_column(const basic_fmtstreambuf<CharT, Traits, ControlTable> &formatter) {
+            auto state = formatter.state();
+            if (!state.at_start_of_line)
+                return state.column;
+            auto &prefix = formatter.line_prefix();
+            return state.indent_level * formatter.indent_increment +
+                   formatter.display_width(prefix.data(), prefix.size());
+        }
+
+        /**
+         * @brief Whether body laid out flat, followed by the pending frames up to their next line break, fits in
+         * the remaining width.
+         * @details Flat subtrees are measured by their flat width, so at most remaining columns are examined.
+         */
+        bool fits(id_type body, size_t remaining) {
+            if (nodes[body].flat_width > remaining)
+                return false;
+            remaining -= nodes[body].flat_width;
+
+            // The rest of the line: pending frames in their own modes until a broken line.
+            lookahead.clear();
+            auto pending = frames.size();
+            while (true) {
+                frame current{};
+                if (!lookahead.empty()) {
+                    current = lookahead.back();
+                    lookahead.pop_back();
+                } else if (pending) {
+                    current = frames[--pending];
+                } else {
+                    return true;
+                }
+                if (current.undent)
+                    continue;
+
+                auto &node = nodes[current.id];
+                if (current.flat || node.kind == doc_kind::text) {
+                    if (node.flat_width > remaining)
+                        return false;
+                    remaining -= node.flat_width;
+                    continue;
+                }
+                switch (node.kind) {
+                    case doc_kind::line:
+                    case doc_kind::softline:
+                        return true;
+                    case doc_kind::concat:
+                        for (auto idx = node.first + node.count; idx > node.first; --idx)
+                            lookahead.push_back(frame{children[idx - 1], false, false});
+                        break;
+                    default:
+                        lookahead.push_back(frame{node.first, false, false});
+                        break;
+                }
+            }
+        }
+    };
+
+    using doc = basic_doc<char>;
+    using wdoc = basic_doc<wchar_t>;
+}
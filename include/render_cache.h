@@ -0,0 +1,196 @@
+//
+// Created by richard on 2019-04-24.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+#include "fd_streambuf.h"
+#include "snippet.h"
+
+namespace fmt {
+
+    /**
+     * @brief A cache of rendered fragments keyed by a hash supplied by the caller.
+     * @details On a miss the producer writes the fragment, text and control codes, to a capture stream; the
+     * capture is compiled to a basic_snippet, so its indentation is kept relative, and stored in an in-memory
+     * LRU bounded by the characters held. On a hit the snippet is replayed at the formatter's current indent
+     * level without running the producer. With a cache directory, captures are also stored there, one file per
+     * key, and read back on a memory miss, so a later run can reuse them. The key must identify everything the
+     * producer's output depends on. The cache may be shared between threads.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table mapping characters to control actions
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_render_cache {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef std::uint64_t key_type;
+        typedef basic_snippet<CharT, Traits, ControlTable> snippet_type;
+
+        static constexpr size_t default_capacity = 16 * 1024 * 1024;
+
+        basic_render_cache(const basic_render_cache &) = delete;
+        basic_render_cache &operator=(const basic_render_cache &) = delete;
+
+        /**
+         * @brief (constructor)
+         * @param capacity the number of characters of fragments kept in memory.
+         * @param directory an existing directory to persist fragments in, or empty for memory only.
+         */
+        explicit basic_render_cache(size_t capacity = default_capacity, std::string directory = {})
+                : capacity{capacity}, directory{std::move(directory)} {}
+
+        /**
+         * @brief Write the fragment for key to formatter, running producer only if it is not cached.
+         * @param formatter the formatter to write to, at its current indent level.
+         * @param key a hash of everything the fragment depends on.
+         * @param producer called as producer(std::basic_ostream<CharT, Traits> &) to write the fragment.
+         * @return false if the formatter did not accept the output.
+         */
+        template<typename Producer>
+        bool render(basic_fmtstreambuf<CharT, Traits, ControlTable> &formatter, key_type key, Producer &&producer) {
+            auto fragment = lookup(key);
+            if (!fragment) {
+                auto source = load(key);
+                if (source.empty()) {
+                    std::basic_ostringstream<CharT, Traits> capture{};
+                    producer(capture);
+                    source = capture.str();
+                    store(key, source);
+                }
+                fragment = std::make_shared<const snippet_type>(source, false);
+                insert(key, fragment);
+            }
+            return fragment->render(formatter);
+        }
+
+        template<typename Producer>
+        bool render(basic_fmtstream<CharT, Traits, ControlTable> &stream, key_type key, Producer &&producer) {
+            return render(*stream.formatter(), key, std::forward<Producer>(producer));
+        }
+
+        size_t hits() const {
+            std::lock_guard<std::mutex> lock{mutex};
+            return hit_count;
+        }
+
+        size_t misses() const {
+            std::lock_guard<std::mutex> lock{mutex};
+            return miss_count;
+        }
+
+    protected:
+        struct entry {
+            key_type key;
+            std::shared_ptr<const snippet_type> fragment;
+        };
+
+        size_t capacity;
+        std::string directory;
+        mutable std::mutex mutex{};
+        std::list<entry> lru{};     ///< Most recently used first.
+        std::unordered_map<key_type, typename std::list<entry>::iterator> index{};
+        size_t held{0};
+        size_t hit_count{0};
+        size_t miss_count{0};
+
+        std::shared_ptr<const snippet_type> lookup(key_type key) {
+            std::lock_guard<std::mutex> lock{mutex};
+            auto found = index.find(key);
+            if (found == index.end()) {
+                ++miss_count;
+                return nullptr;
+            }
+            ++hit_count;
+            lru.splice(lru.begin(), lru, found->second);
+            return found->second->fragment;
+        }
+
+        void insert(key_type key, std::shared_ptr<const snippet_type> fragment) {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (index.count(key))
+                return;
+            held += fragment->size();
+            lru.push_front(entry{key, std::move(fragment)});
+            index[key] = lru.begin();
+            while (held > capacity && lru.size() > 1) {
+                held -= lru.back().fragment->size();
+                index.erase(lru.back().key);
+                lru.pop_back();
+            }
+        }
+
+        std::string path_of(key_type key) const {
+            char name[24];
+            std::snprintf(name, sizeof(name), "/%016llx.frag", static_cast<unsigned long long>(key));
+            return directory + name;
+        }
+
+        /**
+         * @brief Read a persisted capture; empty if there is none.
+         */
+        std::basic_string<CharT, Traits> load(key_type key) const {
+            std::basic_string<CharT, Traits> source{};
+            if (directory.empty())
+                return source;
+            int fd = ::open(path_of(key).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return source;
+            struct stat st{};
+            if (::fstat(fd, &st) == 0 && st.st_size % sizeof(CharT) == 0) {
+                source.resize(static_cast<size_t>(st.st_size) / sizeof(CharT));
+                auto data = reinterpret_cast<char *>(&source[0]);
+                size_t done = 0;
+                while (done < static_cast<size_t>(st.st_size)) {
+                    auto n = ::read(fd, data + done, static_cast<size_t>(st.st_size) - done);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        break;
+                    done += static_cast<size_t>(n);
+                }
+                if (done != static_cast<size_t>(st.st_size))
+                    source.clear();
+            }
+            ::close(fd);
+            return source;
+        }
+
+        /**
+         * @brief Persist a capture, atomically so concurrent runs never read a partial file.
+         */
+        void store(key_type key, const std::basic_string<CharT, Traits> &source) const {
+            if (directory.empty() || source.empty())
+                return;
+            auto path = path_of(key);
+            auto temp_path = path + ".XXXXXX";
+            int fd = ::mkstemp(&temp_path[0]);
+            if (fd < 0)
+                return;
+            bool ok;
+            {
+                exp::basic_fd_streambuf<CharT, Traits> file{fd, 0, true};
+                auto size = static_cast<std::streamsize>(source.size());
+                ok = file.sputn(source.data(), size) == size;
+            }
+            if (!ok || ::rename(temp_path.c_str(), path.c_str()) != 0)
+                ::unlink(temp_path.c_str());
+        }
+    };
+
+    using render_cache = basic_render_cache<char>;
+}
@@ -0,0 +1,229 @@
+//
+// Created by richard on 2019-04-21.
+//
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "fd_streambuf.h"
+
+namespace exp {
+
+    /**
+     * @brief An output stream buffer which collects text in a rope with placeholders filled in later.
+     * @details Text is written into fixed size blocks which are never moved or copied as the rope grows; the
+     * rope is a list of pieces of those blocks. placeholder() marks the current position; the marked section
+     * can be filled afterwards, with text or with the whole of another rope, by splicing it into the list of
+     * pieces in constant time. Use as the next buffer of a basic_fmtstreambuf to generate a section, such as
+     * forward declarations, whose content is only known once later code has been generated. write_to()
+     * flattens the rope to a file descriptor or another buffer with gather writes.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_rope_streambuf
+            : public std::basic_streambuf<CharT, Traits>, public basic_gather_sink<CharT, Traits> {
+    protected:
+        struct piece {
+            const CharT *data{nullptr};
+            size_t size{0};
+        };
+
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef typename Traits::int_type int_type;
+        typedef typename Traits::pos_type pos_type;
+        typedef typename Traits::off_type off_type;
+        typedef typename basic_gather_sink<CharT, Traits>::segment_type segment_type;
+
+        static constexpr size_t default_block_size = 16 * 1024;
+
+        /**
+         * @brief A marked position in a rope, filled once with fill().
+         */
+        class placeholder_type {
+        public:
+            placeholder_type() = default;
+
+        protected:
+            friend class basic_rope_streambuf;
+
+            explicit placeholder_type(typename std::list<piece>::iterator marker) : marker{marker}, valid{true} {}
+
+            typename std::list<piece>::iterator marker{};
+            bool valid{false};
+        };
+
+        basic_rope_streambuf(const basic_rope_streambuf &) = delete;
+        basic_rope_streambuf &operator=(const basic_rope_streambuf &) = delete;
+
+        /**
+         * @brief (constructor)
+         * @param block_size the size in characters of the blocks text is written into.
+         */
+        explicit basic_rope_streambuf(size_t block_size = default_block_size) : block_size{block_size} {}
+
+        /**
+         * @brief Mark the current position so text can be inserted there later.
+         */
+        placeholder_type placeholder() {
+            commit_piece();
+            auto marker = pieces.emplace(pieces.end());
+            if (this->pbase()) {
+                // Carry on writing in the rest of the block.
+                pieces.emplace_back(piece{this->pptr(), 0});
+                this->setp(this->pptr(), this->epptr());
+            }
+            return placeholder_type{marker};
+        }
+
+        /**
+         * @brief Fill a placeholder with a copy of text.
+         * @return false if the placeholder was already filled.
+         */
+        bool fill(placeholder_type &position, std::basic_string_view<CharT, Traits> text) {
+            if (!position.valid)
+                return false;
+            auto block = blocks.emplace_back(std::make_unique<CharT[]>(text.size())).get();
+            traits_type::copy(block, text.data(), text.size());
+            *position.marker = piece{block, text.size()};
+            position.valid = false;
+            return true;
+        }
+
+        /**
+         * @brief Fill a placeholder with the contents of another rope, which is left empty.
+         * @details The other rope's blocks and pieces are spliced in without copying; placeholders in it stay
+         * valid and now refer to positions in this rope.
+         * @return false if the placeholder was already filled.
+         */
+        bool fill(placeholder_type &position, basic_rope_streambuf &other) {
+            if (!position.valid)
+                return false;
+            other.commit_piece();
+            other.setp(nullptr, nullptr);
+            blocks.splice(blocks.end(), other.blocks);
+            pieces.splice(position.marker, other.pieces);
+            pieces.erase(position.marker);
+            position.valid = false;
+            return true;
+        }
+
+        /**
+         * @brief Move the contents of another rope, which is left empty, to the end of this one without copying.
+         */
+        void append(basic_rope_streambuf &other) {
+            commit_piece();
+            other.commit_piece();
+            other.setp(nullptr, nullptr);
+            blocks.splice(blocks.end(), other.blocks);
+            pieces.splice(pieces.end(), other.pieces);
+            this->setp(nullptr, nullptr);
+        }
+
+        /**
+         * @brief The number of characters in the rope.
+         */
+        size_t size() {
+            commit_piece();
+            size_t total = 0;
+            for (auto &p : pieces)
+                total += p.size;
+            return total;
+        }
+
+        std::basic_string<CharT, Traits> str() {
+            std::basic_string<CharT, Traits> text{};
+            text.reserve(size());
+            for (auto &p : pieces)
+                text.append(p.data, p.size);
+            return text;
+        }
+
+        /**
+         * @brief Write the rope to a buffer, with gather writes if it supports them.
+         * @return the number of characters written.
+         */
+        std::streamsize write_to(std::basic_streambuf<CharT, Traits> *sink) {
+            commit_piece();
+            auto gather = gather_sink_of(sink);
+            segment_type segments[64];
+            constexpr size_t max_segments = sizeof(segments) / sizeof(segments[0]);
+            std::streamsize total = 0;
+            auto p = pieces.begin();
+            while (p != pieces.end()) {
+                size_t used = 0;
+                std::streamsize size = 0;
+                for (; used < max_segments && p != pieces.end(); ++p) {
+                    if (!p->size)
+                        continue;
+                    segments[used++] = segment_type{p->data, p->size};
+                    size += static_cast<std::streamsize>(p->size);
+                }
+                auto n = sputv(sink, gather, segments, used);
+                total += std::max<std::streamsize>(n, 0);
+                if (n != size)
+                    break;
+            }
+            return total;
+        }
+
+        /**
+         * @brief Write the rope to a file descriptor with writev(2).
+         * @return true if everything was written.
+         */
+        bool write_to(int fd) {
+            basic_fd_streambuf<CharT, Traits> sink{fd, 0};
+            auto total = static_cast<std::streamsize>(size());
+            return write_to(&sink) == total;
+        }
+
+        std::streamsize gather_write(const segment_type *segments, size_t count) override {
+            std::streamsize total = 0;
+            for (size_t idx = 0; idx < count; ++idx)
+                total += this->sputn(segments[idx].data(), static_cast<std::streamsize>(segments[idx].size()));
+            return total;
+        }
+
+    protected:
+        std::list<std::unique_ptr<CharT[]>> blocks{};
+        std::list<piece> pieces{};
+        size_t block_size;
+
+        /**
+         * @brief Record the text written to the put area in the last piece, which it belongs to.
+         */
+        void commit_piece() {
+            if (this->pbase())
+                pieces.back().size = static_cast<size_t>(this->pptr() - this->pbase());
+        }
+
+        /**
+         * @brief Start a new block when the current one is full.
+         * @param c the overflow character
+         * @return c as an integer.
+         */
+        int_type overflow(int_type c) override {
+            commit_piece();
+            auto block = blocks.emplace_back(std::make_unique<CharT[]>(block_size)).get();
+            pieces.emplace_back(piece{block, 0});
+            this->setp(block, block + block_size);
+
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *this->pptr() = traits_type::to_char_type(c);
+                this->pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        int sync() override {
+            return 0;
+        }
+    };
+
+    using rope_streambuf = basic_rope_streambuf<char>;
+}
@@ -0,0 +1,114 @@
+//
+// Created by richard on 2019-04-22.
+//
+
+#pragma once
+
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "code_fmt_stream.h"
+#include "rope_streambuf.h"
+
+namespace fmt {
+
+    /**
+     * @brief A set of named sections of one output, each written through its own basic_fmtstream.
+     * @details Every section has its own rope buffer and formatter, so its indentation and start of line state
+     * are independent of the others, and different sections may be written by different threads at the same
+     * time (each section by one thread at a time). finalize() joins the sections in the order they were
+     * declared by splicing their ropes together and writes the result with gather writes, so section text is
+     * not copied again.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>>
+    class basic_section_set {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef std::basic_string_view<CharT, Traits> string_view_type;
+
+        basic_section_set() = delete;
+        basic_section_set(const basic_section_set &) = delete;
+        basic_section_set &operator=(const basic_section_set &) = delete;
+
+        /**
+         * @brief (constructor)
+         * @param names the sections in output order.
+         */
+        explicit basic_section_set(std::initializer_list<string_view_type> names) {
+            for (auto name : names)
+                sections.push_back(std::make_unique<section_type>(name));
+        }
+
+        size_t size() const {
+            return sections.size();
+        }
+
+        /**
+         * @brief The stream for the section with the given name.
+         * @throws std::out_of_range if there is no such section.
+         */
+        basic_fmtstream<CharT, Traits> &section(string_view_type name) {
+            for (auto &s : sections)
+                if (string_view_type{s->name} == name)
+                    return s->stream;
+            throw std::out_of_range("fmt::basic_section_set: no such section");
+        }
+
+        basic_fmtstream<CharT, Traits> &section(size_t index) {
+            return sections.at(index)->stream;
+        }
+
+        /**
+         * @brief Concatenate the sections in declared order and write them to sink.
+         * @details Sections must not be written while this runs. Afterwards the sections are empty and keep
+         * their formatting state.
+         * @return false if the sink did not accept all the output.
+         */
+        bool finalize(std::basic_streambuf<CharT, Traits> *sink) {
+            exp::basic_rope_streambuf<CharT, Traits> whole{};
+            if (!join(whole))
+                return false;
+            auto total = static_cast<std::streamsize>(whole.size());
+            return whole.write_to(sink) == total;
+        }
+
+        /**
+         * @brief Concatenate the sections in declared order and write them to a file descriptor with writev(2).
+         * @return false if not all the output was written.
+         */
+        bool finalize(int fd) {
+            exp::basic_rope_streambuf<CharT, Traits> whole{};
+            return join(whole) && whole.write_to(fd);
+        }
+
+    protected:
+        struct section_type {
+            std::basic_string<CharT, Traits> name;
+            exp::basic_rope_streambuf<CharT, Traits> rope{};
+            basic_fmtstream<CharT, Traits> stream{&rope};
+
+            explicit section_type(string_view_type name) : name{name} {}
+        };
+
+        std::vector<std::unique_ptr<section_type>> sections{};
+
+        bool join(exp::basic_rope_streambuf<CharT, Traits> &whole) {
+            bool ok = true;
+            for (auto &s : sections) {
+                // Text held by the formatter, after a soft break or in an aligned run, goes out first.
+                ok = s->stream.formatter()->pubsync() == 0 && ok;
+                whole.append(s->rope);
+            }
+            return ok;
+        }
+    };
+
+    using section_set = basic_section_set<char>;
+}
@@ -0,0 +1,207 @@
+//
+// Created by richard on 2019-04-20.
+//
+
+#pragma once
+
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "code_fmt_stream.h"
+
+namespace fmt {
+
+    /**
+     * @brief A fragment of formatted text compiled once and rendered many times.
+     * @details The source is text and control codes with {{name}} substitution slots. Compiling splits it into
+     * runs of text, each ending at most at one end of line, relative indent deltas, other control codes and
+     * slots, so rendering does not scan for control codes or slots again. A snippet is rendered through a
+     * basic_fmtstreambuf at whatever indent level the formatter is at; runs and slot values are written in the
+     * formatter's raw text mode, straight from the snippet's storage and the caller's values.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table mapping characters to control actions
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_snippet {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef std::basic_string_view<CharT, Traits> string_view_type;
+
+        basic_snippet() = delete;
+
+        /**
+         * @brief (constructor)
+         * @details Compiles source. A {{ without a closing }} is text.
+         * @param source the text, control codes and slots of the fragment.
+         * @param with_slots if false {{name}} is text, for fragments captured from other output.
+         */
+        explicit basic_snippet(string_view_type source, bool with_slots = true) {
+            compile(source, with_slots);
+        }
+
+        /**
+         * @brief The number of characters of text stored.
+         */
+        size_t size() const {
+            return text.size();
+        }
+
+        /**
+         * @brief The slot names in order of first appearance; values are passed to render() in this order.
+         */
+        const std::vector<std::basic_string<CharT, Traits>> &slots() const {
+            return slot_names;
+        }
+
+        /**
+         * @brief The index of a named slot, or slots().size() if there is no such slot.
+         */
+        size_t slot_index(string_view_type name) const {
+            size_t idx = 0;
+            while (idx < slot_names.size() && string_view_type{slot_names[idx]} != name)
+                ++idx;
+            return idx;
+        }
+
+        /**
+         * @brief Render the snippet at the formatter's current indent level.
+         * @param formatter the formatter to write to.
+         * @param values the slot values, by slot index; missing values are empty.
+         * @param value_count the number of values.
+         * @return false if the formatter did not accept the output.
+         */
+        bool render(basic_fmtstreambuf<CharT, Traits, ControlTable> &formatter,
+                    const string_view_type *values, size_t value_count) const {
+            bool raw_text = formatter.raw_text;
+            formatter.raw_text = true;
+            bool ok = true;
+            for (auto op = ops.begin(); ok && op != ops.end(); ++op) {
+                switch (op->kind) {
+                    case op_kind::text:
+                        ok = put(formatter, string_view_type{text.data() + op->value, op->size});
+                        break;
+                    case op_kind::slot:
+                        if (op->value < value_count)
+                            ok = put(formatter, values[op->value]);
+                        break;
+                    case op_kind::indent:
+                        for (size_t level = 0; level < op->size; ++level)
+                            formatter.indent();
+                        break;
+                    case op_kind::undent:
+                        for (size_t level = 0; level < op->size; ++level)
+                            formatter.undent();
+                        break;
+                    case op_kind::control: {
+                        auto code = traits_type::to_char_type(static_cast<typename Traits::int_type>(op->value));
+                        formatter.raw_text = false;
+                        ok = formatter.sputn(&code, 1) == 1;
+                        formatter.raw_text = true;
+                        break;
+                    }
+                }
+            }
+            formatter.raw_text = raw_text;
+            return ok;
+        }
+
+        bool render(basic_fmtstreambuf<CharT, Traits, ControlTable> &formatter,
+                    std::initializer_list<string_view_type> values = {}) const {
+            return render(formatter, values.begin(), values.size());
+        }
+
+        bool render(basic_fmtstream<CharT, Traits, ControlTable> &stream,
+                    std::initializer_list<string_view_type> values = {}) const {
+            return render(*stream.formatter(), values.begin(), values.size());
+        }
+
+    protected:
+        enum class op_kind : unsigned char {
+            text,       ///< value is the offset of the run in text.
+            slot,       ///< value is the slot index.
+            indent,     ///< size is the number of levels.
+            undent,     ///< size is the number of levels.
+            control,    ///< value is the control code.
+        };
+
+        struct op_type {
+            op_kind kind;
+            size_t value;
+            size_t size;
+        };
+
+        std::vector<op_type> ops{};
+        std::basic_string<CharT, Traits> text{};
+        std::vector<std::basic_string<CharT, Traits>> slot_names{};
+
+        static bool put(basic_fmtstreambuf<CharT, Traits, ControlTable> &formatter, string_view_type run) {
+            auto size = static_cast<std::streamsize>(run.size());
+            return !size || formatter.sputn(run.data(), size) == size;
+        }
+
+        void add_text(string_view_type run) {
+            if (run.empty())
+                return;
+            ops.push_back(op_type{op_kind::text, text.size(), run.size()});
+            text.append(run);
+        }
+
+        void add_level(op_kind kind) {
+            if (!ops.empty() && ops.back().kind == kind)
+                ++ops.back().size;
+            else
+                ops.push_back(op_type{kind, 0, 1});
+        }
+
+        void compile(string_view_type source, bool with_slots) {
+            const char_type open[2]{char_type('{'), char_type('{')};
+            const char_type close[2]{char_type('}'), char_type('}')};
+            size_t run = 0;
+            for (size_t idx = 0; idx < source.size();) {
+                auto c = source[idx];
+                if (with_slots && source.compare(idx, 2, open, 2) == 0) {
+                    auto end = source.find(string_view_type{close, 2}, idx + 2);
+                    if (end == string_view_type::npos) {
+                        ++idx;
+                        continue;
+                    }
+                    add_text(source.substr(run, idx - run));
+                    auto slot = slot_index(source.substr(idx + 2, end - idx - 2));
+                    if (slot == slot_names.size())
+                        slot_names.emplace_back(source.substr(idx + 2, end - idx - 2));
+                    ops.push_back(op_type{op_kind::slot, slot, 0});
+                    run = idx = end + 2;
+                    continue;
+                }
+
+                auto action = ControlTable::template action<CharT, Traits>(c);
+                if (action == control_action::end_of_line) {
+                    add_text(source.substr(run, idx + 1 - run));
+                    run = ++idx;
+                    continue;
+                }
+                if (action != control_action::text) {
+                    add_text(source.substr(run, idx - run));
+                    if (action == control_action::indent)
+                        add_level(op_kind::indent);
+                    else if (action == control_action::undent)
+                        add_level(op_kind::undent);
+                    else
+                        ops.push_back(op_type{op_kind::control, static_cast<size_t>(traits_type::to_int_type(c)), 0});
+                    run = ++idx;
+                    continue;
+                }
+                ++idx;
+            }
+            add_text(source.substr(run));
+        }
+    };
+
+    using snippet = basic_snippet<char>;
+    using wsnippet = basic_snippet<wchar_t>;
+}
@@ -0,0 +1,122 @@
+//
+// Created by richard on 2019-05-06.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <streambuf>
+#include <string_view>
+
+/**
+ * @brief Optional interfaces shared by the stream buffers of both the exp and fmt namespaces.
+ * @details Kept apart from streams.h so that the formatter can use them without declaring the exp namespace,
+ * which clashes with the exp() function of <cmath>.
+ */
+namespace io {
+
+    /**
+     * @brief An optional interface for stream buffers which can accept several discontiguous spans
+     * of characters in one operation.
+     * @details Filters which produce output in pieces (an indentation prefix and a line, a header and
+     * a payload) can hand all the pieces to a sink implementing this interface without first copying
+     * them into a contiguous buffer. Use sputv() to write to any std::basic_streambuf; it falls back
+     * to a sequence of sputn() calls when the buffer does not implement the interface.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_gather_sink {
+    public:
+        typedef std::basic_string_view<CharT, Traits> segment_type;
+
+        virtual ~basic_gather_sink() = default;
+
+        /**
+         * @brief Write a sequence of segments, in order, as if they were one contiguous span.
+         * @param segments a pointer to the first segment.
+         * @param count the number of segments.
+         * @return the total number of characters accepted. As with std::basic_streambuf::sputn() the count is
+         * short, never negative, if the sink fails or, for a resumable_sink, would block part way.
+         */
+        virtual std::streamsize gather_write(const segment_type *segments, size_t count) = 0;
+    };
+
+    /**
+     * @brief Return the gather interface of a stream buffer, or nullptr if it does not have one.
+     * @details Filters should call this once, when they are attached to their next buffer, and keep
+     * the result.
+     */
+    template<typename CharT, typename Traits>
+    basic_gather_sink<CharT, Traits> *gather_sink_of(std::basic_streambuf<CharT, Traits> *buffer) {
+        return dynamic_cast<basic_gather_sink<CharT, Traits> *>(buffer);
+    }
+
+    /**
+     * @brief Write a sequence of segments to a stream buffer.
+     * @param buffer the destination buffer.
+     * @param gather the gather interface of buffer, as returned by gather_sink_of(), or nullptr.
+     * @param segments a pointer to the first segment.
+     * @param count the number of segments.
+     * @return the total number of characters accepted, short if the buffer failed or would block.
+     */
+    template<typename CharT, typename Traits>
+    std::streamsize sputv(std::basic_streambuf<CharT, Traits> *buffer, basic_gather_sink<CharT, Traits> *gather,
+                          const std::basic_string_view<CharT, Traits> *segments, size_t count) {
+        if (gather)
+            return gather->gather_write(segments, count);
+
+        std::streamsize total = 0;
+        for (size_t idx = 0; idx < count; ++idx) {
+            auto size = static_cast<std::streamsize>(segments[idx].size());
+            auto n = buffer->sputn(segments[idx].data(), size);
+            total += n;
+            if (n != size)
+                break;
+        }
+        return total;
+    }
+
+    template<typename CharT, typename Traits>
+    std::streamsize sputv(std::basic_streambuf<CharT, Traits> *buffer,
+                          const std::basic_string_view<CharT, Traits> *segments, size_t count) {
+        return sputv(buffer, gather_sink_of(buffer), segments, count);
+    }
+
+    /**
+     * @brief An optional interface for stream buffers which hold output back when their destination would
+     * block, as a non-blocking file descriptor does.
+     * @details A buffer which can not pass output on accepts what it can hold and returns a short count for the
+     * rest, which stays with the caller; nothing accepted is lost and nothing is written twice. An event loop
+     * waits for the destination to become writable and calls resume() on the head of the chain, which resumes
+     * the rest of the chain, until it returns true; then writing can continue.
+     */
+    class resumable_sink {
+    public:
+        virtual ~resumable_sink() = default;
+
+        /**
+         * @brief True if output is held back because a destination would block.
+         */
+        virtual bool would_block() const = 0;
+
+        /**
+         * @brief The number of characters held back in this buffer and those after it.
+         */
+        virtual size_t pending_bytes() const = 0;
+
+        /**
+         * @brief Try to pass on the output held back.
+         * @return true if nothing is held back any more, false if a destination would still block or failed.
+         */
+        virtual bool resume() = 0;
+    };
+
+    /**
+     * @brief Return the resumable interface of a stream buffer, or nullptr if it does not have one.
+     */
+    template<typename CharT, typename Traits>
+    resumable_sink *resumable_sink_of(std::basic_streambuf<CharT, Traits> *buffer) {
+        return dynamic_cast<resumable_sink *>(buffer);
+    }
+}
@@ -4,14 +4,41 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <iomanip>
+#include <mutex>
+#include <string_view>
+#include "buffer_pool.h"
+#include "flush_policy.h"
+#include "stream_sink.h"
 
 namespace exp {
 
+    using io::basic_gather_sink;
+    using io::gather_sink_of;
+    using io::sputv;
+    using io::resumable_sink;
+    using io::resumable_sink_of;
+
     /**
      * @brief A sub-class of std::basic_streambuf that can be inserted, using a companion stream class,
      * on top of a streambuf to filter the byte stream.
+     * @details When buffered output is flushed through the chain is set by a flush_policy, per stream. By
+     * default the buffer is passed to the next buffer when it fills and the chain is synchronized by sync().
+     * Under flush_trigger::newline and flush_trigger::deadline every write reaches xsputn() or overflow(), so
+     * the policy sees it; under flush_trigger::deadline writes, sync() and the timer thread's flushes are
+     * serialized by a lock, and a derived class which overrides filter_write() must call close() in its own
+     * destructor.
+     *
+     * The write and read buffers are taken from the shared buffer pool when first used, so a write-only stream
+     * has no read buffer. buffer_sizing::release_write and buffer_sizing::release_read return them to the pool
+     * when a flush empties the write buffer or a read finds nothing to read; release_buffers() returns empty
+     * buffers on request. With buffer_sizing bounds the write buffer is adaptive: it is doubled, within the
+     * bounds, when it fills twice between flushes or a single write is larger than it, and halved after several
+     * flushes in a row which found it less than a quarter full. Otherwise the write buffer has the fixed
+     * WriteBufferSize. async_filter_streambuf uses its own fixed buffers.
      * @tparam CharT the character type
      * @tparam Traits the character traits type (usually std::char_traits<CharT>
      * @tparam BufferSize the size of the buffers implemented, default 4096 characters
@@ -21,7 +48,8 @@ namespace exp {
             typename Traits = std::char_traits<CharT>,
             size_t WriteBufferSize = 4096,
             size_t ReadBufferSize = 4096>
-    class basic_filter_streambuf : public std::basic_streambuf<CharT, Traits> {
+    class basic_filter_streambuf
+            : public std::basic_streambuf<CharT, Traits>, public resumable_sink, protected detail::deadline_flushable {
     public:
         typedef CharT char_type;
         typedef Traits traits_type;
@@ -37,26 +65,107 @@ namespace exp {
          * @brief (constructor)
          * @details Creates a filter buffer and attaches its input/output to the next buffer.
          * @param next the next buffer in the chain
+         * @param policy when output is flushed through the chain
+         * @param sizing the bounds of an adaptive write buffer and when buffers are returned to the pool
          */
-        explicit basic_filter_streambuf(std::basic_streambuf<CharT, Traits> *next)
-                : next{next} {
-            this->setp(obuf, obuf + sizeof(obuf));
-            this->setg(ibuf, ibuf + 8, ibuf + 8);
+        explicit basic_filter_streambuf(std::basic_streambuf<CharT, Traits> *next, const flush_policy &policy = {},
+                                        const buffer_sizing &sizing = {})
+                : next{next}, next_resumable{resumable_sink_of(next)}, flush{policy}, sizing{sizing} {
+            if (sizing.max_size) {
+                this->sizing.min_size = std::max<size_t>(std::min(sizing.min_size, sizing.max_size), 1);
+                capacity = std::max(this->sizing.min_size, std::min(write_buffer_size, sizing.max_size));
+            }
         }
 
         /**
          * @brief (destructor)
-         * @details Sync (flush) the output when the buffer is destroyed.
+         * @details Flush the output through the chain when the buffer is destroyed. Output the next buffer
+         * still does not take, because it failed or would block, is lost with the buffer.
          */
         ~basic_filter_streambuf() override {
-            sync();
+            close();
+            free_write_buffer();
+            release_read_buffer();
+        }
+
+        /**
+         * @brief Return the write buffer, if it is empty, and the read buffer, if it has been read, to the
+         * buffer pool, as for a stream which is about to be idle. They are taken again when next used.
+         */
+        void release_buffers() {
+            auto lock = guard();
+            release_write_buffer();
+            if (this->gptr() == this->egptr())
+                release_read_buffer();
+        }
+
+        /**
+         * @brief The current size of the write buffer in characters.
+         */
+        size_t write_capacity() const {
+            return this->pbase() ? area : capacity;
+        }
+
+        const flush_policy &policy() const {
+            return flush;
+        }
+
+        /**
+         * @brief Change the flush policy; buffered output is kept.
+         */
+        void policy(const flush_policy &new_policy) {
+            cancel_deadline();
+            auto lock = guard();
+            flush = new_policy;
+            set_put_area(static_cast<size_t>(this->pptr() - this->pbase()));
+        }
+
+        /**
+         * @brief Flush the output through the chain whatever the policy, as the destructor does.
+         * @return false on failure.
+         */
+        bool close() {
+            cancel_deadline();
+            auto lock = guard();
+            return flush_all() == 0;
+        }
+
+        /**
+         * @brief True if the next buffer would block; characters kept for the filter's own reasons are not.
+         */
+        bool would_block() const override {
+            return next_resumable && next_resumable->would_block();
+        }
+
+        size_t pending_bytes() const override {
+            return static_cast<size_t>(this->pptr() - this->pbase()) +
+                   (next_resumable ? next_resumable->pending_bytes() : 0);
+        }
+
+        bool resume() override {
+            auto lock = guard();
+            if (next_resumable && !next_resumable->resume())
+                return false;
+            return flush_all() == 0 && !would_block();
         }
 
     protected:
 
         std::basic_streambuf<CharT, Traits> *next{nullptr};     ///< Pointer to the next buffer
-        CharT obuf[write_buffer_size];        ///< The output buffer
-        CharT ibuf[read_buffer_size + 8];    ///< The input buffer
+        resumable_sink *next_resumable{nullptr};                 ///< The next buffer's resumable interface
+        flush_policy flush;
+        size_t passed{0};                     ///< Characters passed to the next buffer since it was synchronized.
+        bool scheduled{false};                ///< A deadline flush is scheduled.
+        std::atomic<bool> timed{false};       ///< The flush timer may hold the stream until cancel_deadline().
+        buffer_sizing sizing;
+        size_t capacity{write_buffer_size};   ///< The size of the write buffer taken from the pool.
+        size_t area{0};                       ///< The size of the buffer the put area lies in.
+        size_t fills{0};                      ///< Times the buffer filled since the last flush.
+        size_t quiet_flushes{0};              ///< Flushes in a row which found the buffer mostly empty.
+        std::mutex mutex{};                   ///< Serializes flush_trigger::deadline streams with the timer.
+        CharT *obuf{nullptr};                 ///< The output buffer, from the buffer pool once written.
+        CharT *ibuf{nullptr};                 ///< The input buffer, from the buffer pool once read.
+        size_t read_capacity{0};              ///< Characters read into ibuf after 8 of putback.
 
         /**
          * @brief A virtual method which implements the filter function.
@@ -71,41 +180,296 @@ namespace exp {
         }
 
         /**
-         * @brief Synchronize this buffer with the next, passing data through the buffer.
+         * @brief Lock the stream against the flush timer while it may flush the stream.
+         * @details The timer thread only calls this once timed is set, so it never reads the trigger, which
+         * only changes while the timer does not hold the stream.
+         */
+        std::unique_lock<std::mutex> guard() {
+            if (timed.load(std::memory_order_acquire) || flush.trigger == flush_trigger::deadline)
+                return std::unique_lock<std::mutex>{mutex};
+            return std::unique_lock<std::mutex>{};
+        }
+
+        /**
+         * @brief Remove the stream from the flush timer and wait for a deadline flush in progress.
+         */
+        void cancel_deadline() {
+            if (!timed.load(std::memory_order_acquire))
+                return;
+            detail::flush_timer::instance().cancel(this);
+            std::lock_guard<std::mutex> lock{mutex};
+            scheduled = false;
+            timed.store(false, std::memory_order_release);
+        }
+
+        /**
+         * @brief Synchronize the next buffer after a flush; a derived buffer which owns the next buffer on
+         * another thread passes the request on to it.
          * @return -1 on failure, 0 otherwise.
          */
-        int sync() override {
-            auto n = filter_write(obuf, this->pptr() - obuf);
+        virtual int sync_next() {
+            return next->pubsync();
+        }
 
-            if (n < 0) {
+        /**
+         * @brief Take the write buffer from the buffer pool.
+         */
+        void acquire_write_buffer() {
+            obuf = static_cast<char_type *>(detail::buffer_pool::instance().allocate(capacity * sizeof(char_type)));
+            set_put_buffer(obuf, capacity);
+        }
+
+        /**
+         * @brief Return the write buffer to the buffer pool if it is empty; output waiting in it is kept.
+         */
+        void release_write_buffer() {
+            if (this->pptr() == this->pbase())
+                free_write_buffer();
+        }
+
+        /**
+         * @brief Return the write buffer to the buffer pool, discarding anything in it.
+         */
+        void free_write_buffer() {
+            if (!obuf || this->pbase() != obuf)
+                return;
+            detail::buffer_pool::instance().release(obuf, capacity * sizeof(char_type));
+            obuf = nullptr;
+            area = 0;
+            this->setp(nullptr, nullptr);
+        }
+
+        void release_read_buffer() {
+            if (!ibuf)
+                return;
+            detail::buffer_pool::instance().release(ibuf, (read_capacity + 8) * sizeof(char_type));
+            ibuf = nullptr;
+            this->setg(nullptr, nullptr, nullptr);
+        }
+
+        /**
+         * @brief True if the write buffer can change size: it is adaptive and not replaced by a derived class.
+         */
+        bool adaptive() const {
+            return sizing.max_size && this->pbase() == obuf;
+        }
+
+        /**
+         * @brief Move the held characters to an adaptive buffer of a new size from the buffer pool.
+         */
+        void resize(size_t new_capacity) {
+            if (!obuf) {
+                capacity = new_capacity;
+                return;
+            }
+            auto &pool = detail::buffer_pool::instance();
+            auto held = static_cast<size_t>(this->pptr() - this->pbase());
+            auto buffer = static_cast<char_type *>(pool.allocate(new_capacity * sizeof(char_type)));
+            traits_type::copy(buffer, this->pbase(), held);
+            pool.release(obuf, capacity * sizeof(char_type));
+            obuf = buffer;
+            capacity = new_capacity;
+            set_put_buffer(buffer, capacity, held);
+        }
+
+        /**
+         * @brief Grow an adaptive buffer to hold at least wanted characters, within its bounds.
+         * @return true if it grew.
+         */
+        bool grow(size_t wanted) {
+            if (!adaptive() || capacity >= sizing.max_size || wanted <= capacity)
+                return false;
+            auto new_capacity = capacity;
+            while (new_capacity < wanted && new_capacity < sizing.max_size)
+                new_capacity *= 2;
+            resize(std::min(new_capacity, sizing.max_size));
+            return true;
+        }
+
+        /**
+         * @brief Shrink an adaptive buffer after several flushes which found it less than a quarter full.
+         * @param held the characters buffered when the flush began.
+         */
+        void adapt_to_flush(size_t held) {
+            if (!adaptive())
+                return;
+            quiet_flushes = !fills && held * 4 < capacity ? quiet_flushes + 1 : 0;
+            fills = 0;
+            if (quiet_flushes >= 4 && capacity > sizing.min_size) {
+                quiet_flushes = 0;
+                resize(std::max(sizing.min_size, capacity / 2));
+            }
+        }
+
+        /**
+         * @brief Place the put area in a buffer of size characters, the first held of them already written.
+         * @details A derived class which supplies its own buffers sets them with this, so that the put area
+         * never extends past the buffer whatever the buffer_sizing.
+         */
+        void set_put_buffer(char_type *buffer, size_t size, size_t held = 0) {
+            this->setp(buffer, buffer + size);
+            area = size;
+            set_put_area(held);
+        }
+
+        /**
+         * @brief Reset the put area over the buffer holding held characters, ending it where the policy must
+         * next act so that writes beyond that reach overflow().
+         */
+        void set_put_area(size_t held) {
+            size_t end = area;
+            switch (flush.trigger) {
+                case flush_trigger::newline:
+                case flush_trigger::deadline:
+                    end = held;
+                    break;
+                case flush_trigger::bytes: {
+                    auto due = std::max<size_t>(flush.bytes, 1);
+                    end = std::min(area, std::max(held, due > passed ? due - passed : 0));
+                    break;
+                }
+                default:
+                    break;
+            }
+            auto base = this->pbase();
+            if (!base)
+                return;
+            this->setp(base, base + end);
+            this->pbump(static_cast<int>(held));
+        }
+
+        /**
+         * @brief Pass the buffered characters through the filter to the next buffer.
+         * @details Characters the filter did not process are moved to the front of the buffer and kept for
+         * the next call. Called when the buffer fills and by sync(); a derived buffer may hand the output off
+         * elsewhere.
+         * @param full true if called because the put area is full, false for a flush.
+         * @return false on failure.
+         */
+        virtual bool pass_through(bool /*full*/) {
+            auto base = this->pbase();
+            auto count = this->pptr() - base;
+            auto n = filter_write(base, count);
+
+            if (n < 0)
+                return false;
+            traits_type::move(base, base + n, static_cast<size_t>(count - n));
+            passed += static_cast<size_t>(n);
+            set_put_area(static_cast<size_t>(count - n));
+            return true;
+        }
+
+        /**
+         * @brief Pass the buffered characters through and synchronize the next buffer.
+         * @return -1 on failure, 0 otherwise.
+         */
+        int flush_all() {
+            auto held = static_cast<size_t>(this->pptr() - this->pbase());
+            if (!pass_through(false))
                 return -1;
-            } else if (n == (this->pptr() - obuf)) {
-                this->setp(obuf, obuf + sizeof(obuf));
-            } else {
-                for (ssize_t cp = n; cp < (sizeof(obuf) - n); ++cp) {
-                    obuf[cp - n] = obuf[cp];
+            passed = 0;
+            adapt_to_flush(held);
+            if (sizing.release_write)
+                release_write_buffer();
+            set_put_area(static_cast<size_t>(this->pptr() - this->pbase()));
+            return sync_next() < 0 ? -1 : 0;
+        }
+
+        /**
+         * @brief Copy characters into the buffer, passing it through whenever it fills.
+         * @return the number of characters copied.
+         */
+        std::streamsize put(const char_type *s, std::streamsize count) {
+            if (!this->pbase() && count)
+                acquire_write_buffer();
+            std::streamsize done = 0;
+            while (done < count) {
+                auto held = static_cast<size_t>(this->pptr() - this->pbase());
+                auto room = std::min(static_cast<size_t>(count - done), area - held);
+                if (!room) {
+                    if (++fills >= 2 && grow(capacity + 1))
+                        continue;
+                    if (!pass_through(true) || static_cast<size_t>(this->pptr() - this->pbase()) == area)
+                        break;
+                    continue;
                 }
-                this->setp(obuf, obuf + sizeof(obuf));
-                this->pbump(static_cast<int>(sizeof(obuf) - n));
+                traits_type::copy(this->pptr(), s + done, room);
+                set_put_area(held + room);
+                done += static_cast<std::streamsize>(room);
+            }
+            return done;
+        }
+
+        /**
+         * @brief Write characters and apply the flush policy.
+         * @return the number of characters written.
+         */
+        std::streamsize write(const char_type *s, std::streamsize count) {
+            if (static_cast<size_t>(count) > capacity)
+                grow(static_cast<size_t>(this->pptr() - this->pbase()) + static_cast<size_t>(count));
+            if (flush.trigger == flush_trigger::newline) {
+                auto end = count;
+                while (end && !traits_type::eq(s[end - 1], char_type('\n')))
+                    --end;
+                auto n = put(s, end);
+                if (end && (n < end || flush_all() < 0))
+                    return n;
+                return n + put(s + end, count - end);
             }
-            return 0;
+
+            auto n = put(s, count);
+            auto held = static_cast<size_t>(this->pptr() - this->pbase());
+            if (flush.trigger == flush_trigger::bytes && passed + held >= std::max<size_t>(flush.bytes, 1)) {
+                flush_all();
+            } else if (flush.trigger == flush_trigger::deadline && !scheduled && (held || passed)) {
+                scheduled = true;
+                timed.store(true, std::memory_order_release);
+                detail::flush_timer::instance().schedule(
+                        this, detail::flush_timer::clock_type::now() + flush.max_latency);
+            }
+            return n;
+        }
+
+        std::streamsize xsputn(const char_type *s, std::streamsize count) override {
+            auto lock = guard();
+            return write(s, count);
+        }
+
+        /**
+         * @brief Flush the chain when the deadline passes, on the timer thread.
+         */
+        void deadline_flush() override {
+            auto lock = guard();
+            scheduled = false;
+            if (this->pptr() != this->pbase() || passed)
+                flush_all();
+        }
+
+        /**
+         * @brief Synchronize this buffer with the next, passing data through the buffer, then synchronize the
+         * next buffer. Ignored under flush_trigger::close.
+         * @return -1 on failure, 0 otherwise.
+         */
+        int sync() override {
+            auto lock = guard();
+            if (flush.trigger == flush_trigger::close)
+                return 0;
+            return flush_all();
         }
 
         /**
          * @brief Handle overflow characters
+         * @details Reached when the buffer is full or where the flush policy must act.
          * @param c the overflow character
-         * @return EOF if sync() fails, otherwise c as an integer.
+         * @return EOF if the filter fails or the buffer is still full, otherwise c as an integer.
          */
         int_type overflow(int_type c) override {
-            if (sync() < 0)
-                return traits_type::eof();
+            auto lock = guard();
+            if (traits_type::eq_int_type(c, traits_type::eof()))
+                return pass_through(false) ? traits_type::not_eof(c) : traits_type::eof();
 
-            if (traits_type::not_eof(c)) {
-                char_type cc = traits_type::to_char_type(c);
-                this->xsputn(&cc, 1);
-            }
-
-            return traits_type::to_int_type(c);
+            char_type cc = traits_type::to_char_type(c);
+            return write(&cc, 1) == 1 ? c : traits_type::eof();
         }
 
         /**
@@ -115,7 +479,7 @@ namespace exp {
          * @return the actual number of characters written into ibuf
          */
         virtual std::streamsize filter_read(char_type *ibuf, std::streamsize count) {
-            return next->sgetn(ibuf + 8, sizeof(ibuf) - 8);
+            return next->sgetn(ibuf, count);
         }
 
         /**
@@ -123,9 +487,16 @@ namespace exp {
          * @return The number of characters read into this buffer.
          */
         int_type underflow() override {
-            auto n = filter_read(ibuf + 8, sizeof(ibuf) - 8);
+            if (!ibuf) {
+                auto bytes = detail::buffer_pool::block_size((read_buffer_size + 8) * sizeof(char_type));
+                ibuf = static_cast<char_type *>(detail::buffer_pool::instance().allocate(bytes));
+                read_capacity = bytes / sizeof(char_type) - 8;
+            }
+            auto n = filter_read(ibuf + 8, static_cast<std::streamsize>(read_capacity));
 
-            if (n < 0) {
+            if (n <= 0 && sizing.release_read)
+                release_read_buffer();
+            if (n < 0 || !ibuf) {
                 return traits_type::eof();
             }
             this->setg(ibuf, ibuf + 8, ibuf + 8 + n);
@@ -151,9 +522,11 @@ namespace exp {
     public:
         basic_filter_ostream() = delete;
 
-        explicit basic_filter_ostream(std::basic_streambuf<CharT, Traits> *rdbuf)
+        explicit basic_filter_ostream(std::basic_streambuf<CharT, Traits> *rdbuf, const flush_policy &policy = {},
+                                      const buffer_sizing &sizing = {})
                 : std::basic_ostream<CharT, Traits>{rdbuf} {
-            basic_filter_buffer = new basic_filter_streambuf<CharT, Traits, WriteBufferSize, ReadBufferSize>{rdbuf};
+            basic_filter_buffer =
+                    new basic_filter_streambuf<CharT, Traits, WriteBufferSize, ReadBufferSize>{rdbuf, policy, sizing};
             this->set_rdbuf(basic_filter_buffer);
         }
 
@@ -0,0 +1,217 @@
+//
+// Created by richard on 2019-04-12.
+//
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include "code_fmt_stream.h"
+
+namespace fmt {
+
+    /**
+     * @brief A destination shared by several basic_sync_fmtstream writers.
+     * @details Each commit is written to the next buffer with a single sputn() while holding the sink's
+     * mutex, so committed lines and blocks are never interleaved.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>>
+    class basic_sync_sink {
+    public:
+        basic_sync_sink() = delete;
+        basic_sync_sink(const basic_sync_sink &) = delete;
+        basic_sync_sink &operator=(const basic_sync_sink &) = delete;
+
+        explicit basic_sync_sink(std::basic_streambuf<CharT, Traits> *next) : next{next} {}
+
+        /**
+         * @brief Write a span to the next buffer atomically with respect to other commits.
+         * @return the number of characters written.
+         */
+        std::streamsize commit(const CharT *text, std::streamsize count) {
+            std::lock_guard<std::mutex> lock{mutex};
+            return next->sputn(text, count);
+        }
+
+        /**
+         * @brief Synchronize the next buffer.
+         */
+        int sync() {
+            std::lock_guard<std::mutex> lock{mutex};
+            return next->pubsync();
+        }
+
+    protected:
+        std::basic_streambuf<CharT, Traits> *next;
+        std::mutex mutex{};
+    };
+
+    /**
+     * @brief A private stream buffer which commits complete lines to a basic_sync_sink.
+     * @details Placed under a thread's own basic_fmtstreambuf. Output collects in a private buffer and each time
+     * it ends a line everything up to the end of that line is committed with one write. Between begin_block()
+     * and end_block() nothing is committed, so the whole block is written at once. sync() commits everything,
+     * including a partial line.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table of the formatter above, which decides what ends a line
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_line_sync_streambuf
+            : public std::basic_streambuf<CharT, Traits>, public io::basic_gather_sink<CharT, Traits> {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef typename Traits::int_type int_type;
+        typedef typename io::basic_gather_sink<CharT, Traits>::segment_type segment_type;
+
+        basic_line_sync_streambuf() = delete;
+
+        explicit basic_line_sync_streambuf(basic_sync_sink<CharT, Traits> &sink) : sink{&sink} {}
+
+        ~basic_line_sync_streambuf() override {
+            sync();
+        }
+
+        void begin_block() {
+            ++block_depth;
+        }
+
+        void end_block() {
+            if (block_depth && !--block_depth)
+                commit_lines(0);
+        }
+
+        std::streamsize gather_write(const segment_type *segments, size_t count) override {
+            auto start = pending.size();
+            for (size_t idx = 0; idx < count; ++idx)
+                pending.append(segments[idx]);
+            auto count_written = pending.size() - start;
+            commit_lines(start);
+            return static_cast<std::streamsize>(count_written);
+        }
+
+    protected:
+        basic_sync_sink<CharT, Traits> *sink;
+        std::basic_string<CharT, Traits> pending{};
+        size_t block_depth{0};
+
+        /**
+         * @brief Commit up to the last end of line at or after start.
+         */
+        void commit_lines(size_t start) {
+            if (block_depth)
+                return;
+            for (auto idx = pending.size(); idx > start; --idx) {
+                if (ControlTable::template action<char_type, traits_type>(pending[idx - 1]) ==
+                    control_action::end_of_line) {
+                    sink->commit(pending.data(), static_cast<std::streamsize>(idx));
+                    pending.erase(0, idx);
+                    return;
+                }
+            }
+        }
+
+        std::streamsize xsputn(const char_type *s, std::streamsize count) override {
+            auto start = pending.size();
+            pending.append(s, static_cast<size_t>(count));
+            commit_lines(start);
+            return count;
+        }
+
+        int_type overflow(int_type c) override {
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                auto start = pending.size();
+                pending.push_back(traits_type::to_char_type(c));
+                commit_lines(start);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        int sync() override {
+            if (!block_depth && !pending.empty()) {
+                sink->commit(pending.data(), static_cast<std::streamsize>(pending.size()));
+                pending.clear();
+            }
+            return 0;
+        }
+    };
+
+    /**
+     * @brief A formatting stream for one thread writing to a shared basic_sync_sink.
+     * @details Like std::osyncstream, each writer has its own formatter state (indentation, start of line) and
+     * buffer; complete lines are committed to the shared sink with one locked write, so the lock is taken once
+     * per line rather than for every insertion. Use begin_block()/end_block(), or basic_sync_block, to commit
+     * several lines at once. emit() commits any partial line.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits
+     * @tparam ControlTable the control_table of the formatter
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_sync_fmtstream : public std::basic_ostream<CharT, Traits> {
+    public:
+        basic_sync_fmtstream() = delete;
+
+        explicit basic_sync_fmtstream(basic_sync_sink<CharT, Traits> &sink)
+                : std::basic_ostream<CharT, Traits>{nullptr}, commit_buffer{sink}, filter{&commit_buffer} {
+            this->rdbuf(&filter);
+        }
+
+        void begin_block() {
+            commit_buffer.begin_block();
+        }
+
+        void end_block() {
+            commit_buffer.end_block();
+        }
+
+        /**
+         * @brief Commit everything written so far, including a partial line and text the formatter holds.
+         */
+        void emit() {
+            filter.pubsync();
+        }
+
+        basic_fmtstreambuf<CharT, Traits, ControlTable> *formatter() {
+            return &filter;
+        }
+
+    protected:
+        basic_line_sync_streambuf<CharT, Traits, ControlTable> commit_buffer;
+        basic_fmtstreambuf<CharT, Traits, ControlTable> filter;
+    };
+
+    /**
+     * @brief Commits everything written to a basic_sync_fmtstream during its lifetime as one block.
+     */
+    template<typename CharT,
+            typename Traits = std::char_traits<CharT>,
+            typename ControlTable = default_control_table>
+    class basic_sync_block {
+    public:
+        explicit basic_sync_block(basic_sync_fmtstream<CharT, Traits, ControlTable> &stream) : stream{stream} {
+            stream.begin_block();
+        }
+
+        ~basic_sync_block() {
+            stream.end_block();
+        }
+
+        basic_sync_block(const basic_sync_block &) = delete;
+        basic_sync_block &operator=(const basic_sync_block &) = delete;
+
+    protected:
+        basic_sync_fmtstream<CharT, Traits, ControlTable> &stream;
+    };
+
+    using sync_sink = basic_sync_sink<char>;
+    using sync_fmtstream = basic_sync_fmtstream<char>;
+    using sync_block = basic_sync_block<char>;
+}
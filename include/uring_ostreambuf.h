@@ -0,0 +1,599 @@
+//
+// Created by richard on 2019-04-05.
+//
+
+#pragma once
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <iostream>
+
+// GCC declares exp() as a built-in function and warns about anything else with that name.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbuiltin-declaration-mismatch"
+#endif
+namespace exp {
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+    namespace detail {
+
+        /**
+         * @brief The interface between basic_uring_ostreambuf and the mechanism that performs its writes.
+         * @details Buffers are identified by their index in the buffer pool. Writes complete in the order
+         * they were submitted as far as the file contents are concerned.
+         */
+        class async_writer {
+        public:
+            /**
+             * @brief The outcome of wait().
+             */
+            enum class completion {
+                written,    ///< A write completed and its buffer is free again.
+                failed,     ///< A write failed or was abandoned and its buffer is free again.
+                none,       ///< No write can complete; the buffer index is not set.
+            };
+
+            virtual ~async_writer() = default;
+
+            /**
+             * @brief Queue a write of a pool buffer.
+             * @return false if an earlier write has failed.
+             */
+            virtual bool submit(size_t buffer, const char *data, size_t size) = 0;
+
+            /**
+             * @brief Wait for a submitted write to complete.
+             * @param buffer set to the index of the buffer that is free again, unless completion::none is returned.
+             * @return completion::none if there is nothing left to complete, or the writer can no longer wait for
+             * writes still in flight, whose buffers must not be reused.
+             */
+            virtual completion wait(size_t &buffer) = 0;
+        };
+
+        /**
+         * @brief An async_writer which performs the writes on a dedicated thread.
+         * @details Used when io_uring is not available.
+         */
+        class thread_writer : public async_writer {
+        public:
+            explicit thread_writer(int fd) : fd{fd}, thread{[this] { run(); }} {}
+
+            ~thread_writer() override {
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    stopping = true;
+                }
+                cv.notify_all();
+                thread.join();
+            }
+
+            bool submit(size_t buffer, const char *data, size_t size) override {
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    if (failed)
+                        return false;
+                    queued.push_back(request{buffer, data, size});
+                }
+                cv.notify_all();
+                return true;
+            }
+
+            completion wait(size_t &buffer) override {
+                std::unique_lock<std::mutex> lock{mutex};
+                cv.wait(lock, [this] { return !completed.empty(); });
+                buffer = completed.front().first;
+                bool ok = completed.front().second;
+                completed.pop_front();
+                return ok ? completion::written : completion::failed;
+            }
+
+        protected:
+            struct request {
+                size_t buffer;
+                const char *data;
+                size_t size;
+            };
+
+            int fd;
+            std::mutex mutex{};
+            std::condition_variable cv{};
+            std::deque<request> queued{};
+            std::deque<std::pair<size_t, bool>> completed{};
+            bool stopping{false};
+            bool failed{false};
+            std::thread thread;
+
+            void run() {
+                std::unique_lock<std::mutex> lock{mutex};
+                while (true) {
+                    cv.wait(lock, [this] { return stopping || !queued.empty(); });
+                    if (queued.empty())
+                        return;
+
+                    auto req = queued.front();
+                    queued.pop_front();
+                    bool ok = !failed;
+                    lock.unlock();
+
+                    while (ok && req.size) {
+                        auto n = ::write(fd, req.data, req.size);
+                        if (n < 0) {
+                            ok = errno == EINTR;
+                            continue;
+                        }
+                        req.data += n;
+                        req.size -= static_cast<size_t>(n);
+                    }
+
+                    lock.lock();
+                    failed = failed || !ok;
+                    completed.emplace_back(req.buffer, ok);
+                    cv.notify_all();
+                }
+            }
+        };
+
+        /**
+         * @brief An async_writer which submits writes from registered buffers to an io_uring.
+         * @details Writes to seekable files are issued at explicit offsets and may be in flight together;
+         * writes to pipes, sockets and O_APPEND files are issued one at a time to keep them in order.
+         * Short writes are resubmitted for the remainder.
+         */
+        class uring_writer : public async_writer {
+        public:
+            /**
+             * @brief Create a writer for fd with the buffer pool registered, or nullptr if io_uring can
+             * not be used.
+             */
+            static std::unique_ptr<uring_writer> create(int fd, char *pool, size_t buffer_size, size_t buffer_count) {
+                std::unique_ptr<uring_writer> writer{new uring_writer{fd, buffer_count}};
+                if (!writer->setup(pool, buffer_size, buffer_count))
+                    return nullptr;
+                return writer;
+            }
+
+            ~uring_writer() override {
+                if (seekable)
+                    ::lseek(fd, static_cast<off_t>(next_offset), SEEK_SET);
+                if (sq_ring != MAP_FAILED)
+                    ::munmap(sq_ring, sq_ring_size);
+                if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+                    ::munmap(cq_ring, cq_ring_size);
+                if (sqes != MAP_FAILED)
+                    ::munmap(sqes, sqes_size);
+                if (ring_fd >= 0)
+                    ::close(ring_fd);
+            }
+
+            bool submit(size_t buffer, const char *data, size_t size) override {
+                if (failed)
+                    return false;
+                queued.push_back(request{buffer, data, size, next_offset});
+                if (seekable)
+                    next_offset += size;
+                if (pump())
+                    return true;
+                // The new request is last in the queue and was not consumed; the caller keeps its buffer.
+                queued.pop_back();
+                return false;
+            }
+
+            completion wait(size_t &buffer) override {
+                while (completed.empty()) {
+                    if (!failed)
+                        pump();
+                    if (failed && !queued.empty()) {
+                        // Requests which were never submitted are returned unwritten.
+                        buffer = queued.front().buffer;
+                        queued.pop_front();
+                        return completion::failed;
+                    }
+                    if (!in_flight)
+                        return completion::none;
+                    if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                        failed = true;
+                        return completion::none;
+                    }
+                    reap();
+                }
+                buffer = completed.front();
+                completed.pop_front();
+                return failed ? completion::failed : completion::written;
+            }
+
+        protected:
+            struct request {
+                size_t buffer;
+                const char *data;
+                size_t size;
+                uint64_t offset;
+            };
+
+            int fd;
+            int ring_fd{-1};
+            bool seekable{false};
+            bool failed{false};
+            uint64_t next_offset{0};
+            size_t max_in_flight{1};
+            size_t in_flight{0};
+            std::vector<request> slots{};
+            std::vector<size_t> free_slots{};
+            std::deque<request> queued{};
+            std::deque<size_t> completed{};
+
+            void *sq_ring{MAP_FAILED};
+            void *cq_ring{MAP_FAILED};
+            void *sqes{MAP_FAILED};
+            size_t sq_ring_size{0};
+            size_t cq_ring_size{0};
+            size_t sqes_size{0};
+            unsigned *sq_tail{nullptr};
+            unsigned *sq_mask{nullptr};
+            unsigned *sq_array{nullptr};
+            unsigned *cq_head{nullptr};
+            unsigned *cq_tail{nullptr};
+            unsigned *cq_mask{nullptr};
+            io_uring_cqe *cqes{nullptr};
+
+            uring_writer(int fd, size_t buffer_count) : fd{fd}, slots(buffer_count) {
+                for (size_t idx = buffer_count; idx > 0; --idx)
+                    free_slots.push_back(idx - 1);
+            }
+
+            int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+                return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                                                  nullptr, 0));
+            }
+
+            bool setup(char *pool, size_t buffer_size, size_t buffer_count) {
+                io_uring_params params{};
+                ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, static_cast<unsigned>(buffer_count), &params));
+                if (ring_fd < 0)
+                    return false;
+
+                sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                if (params.features & IORING_FEAT_SINGLE_MMAP)
+                    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+                sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring_fd, IORING_OFF_SQ_RING);
+                if (sq_ring == MAP_FAILED)
+                    return false;
+                if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                    cq_ring = sq_ring;
+                } else {
+                    cq_ring = ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ring_fd, IORING_OFF_CQ_RING);
+                    if (cq_ring == MAP_FAILED)
+                        return false;
+                }
+                sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+                sqes = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_SQES);
+                if (sqes == MAP_FAILED)
+                    return false;
+
+                auto sq = static_cast<char *>(sq_ring);
+                sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+                sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+                sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+                auto cq = static_cast<char *>(cq_ring);
+                cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+                cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+                cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+                cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+                std::vector<iovec> iov(buffer_count);
+                for (size_t idx = 0; idx < buffer_count; ++idx) {
+                    iov[idx].iov_base = pool + idx * buffer_size;
+                    iov[idx].iov_len = buffer_size;
+                }
+                if (::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov.data(),
+                              static_cast<unsigned>(buffer_count)) < 0)
+                    return false;
+
+                struct stat st{};
+                auto flags = ::fcntl(fd, F_GETFL);
+                if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND)) {
+                    auto offset = ::lseek(fd, 0, SEEK_CUR);
+                    if (offset >= 0) {
+                        seekable = true;
+                        next_offset = static_cast<uint64_t>(offset);
+                        max_in_flight = buffer_count;
+                    }
+                }
+                return true;
+            }
+
+            /**
+             * @brief Move queued requests into the submission ring while the in-flight limit allows.
+             * @details Only the requests the kernel consumes are counted in flight; the rest are taken back out
+             * of the ring and returned to the front of the queue.
+             * @return false on failure.
+             */
+            bool pump() {
+                unsigned tail = *sq_tail;
+                unsigned count = 0;
+                while (!queued.empty() && in_flight + count < max_in_flight) {
+                    auto slot = free_slots.back();
+                    free_slots.pop_back();
+                    slots[slot] = queued.front();
+                    queued.pop_front();
+
+                    unsigned index = (tail + count) & *sq_mask;
+                    auto sqe = static_cast<io_uring_sqe *>(sqes) + index;
+                    std::memset(sqe, 0, sizeof(*sqe));
+                    sqe->opcode = IORING_OP_WRITE_FIXED;
+                    sqe->fd = fd;
+                    sqe->addr = reinterpret_cast<uint64_t>(slots[slot].data);
+                    sqe->len = static_cast<uint32_t>(slots[slot].size);
+                    sqe->off = seekable ? slots[slot].offset : static_cast<uint64_t>(-1);
+                    sqe->buf_index = static_cast<uint16_t>(slots[slot].buffer);
+                    sqe->user_data = slot;
+                    sq_array[index] = index;
+                    ++count;
+                }
+                if (!count)
+                    return true;
+                __atomic_store_n(sq_tail, tail + count, __ATOMIC_RELEASE);
+
+                unsigned submitted = 0;
+                while (submitted < count) {
+                    auto n = enter(count - submitted, 0, 0);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        break;
+                    submitted += static_cast<unsigned>(n);
+                }
+                in_flight += submitted;
+                if (submitted == count)
+                    return true;
+
+                // The kernel only reads the ring during io_uring_enter, so the entries it did not consume can be
+                // withdrawn by moving the tail back.
+                __atomic_store_n(sq_tail, tail + submitted, __ATOMIC_RELEASE);
+                for (auto idx = count; idx > submitted; --idx) {
+                    auto sqe = static_cast<io_uring_sqe *>(sqes) + ((tail + idx - 1) & *sq_mask);
+                    auto slot = static_cast<size_t>(sqe->user_data);
+                    queued.push_front(slots[slot]);
+                    free_slots.push_back(slot);
+                }
+                failed = true;
+                return false;
+            }
+
+            /**
+             * @brief Process completions, resubmitting the remainder of short writes.
+             */
+            void reap() {
+                unsigned head = *cq_head;
+                unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; ++head) {
+                    auto &cqe = cqes[head & *cq_mask];
+                    auto slot = static_cast<size_t>(cqe.user_data);
+                    auto req = slots[slot];
+                    free_slots.push_back(slot);
+                    --in_flight;
+
+                    if (cqe.res < 0 && cqe.res != -EINTR && cqe.res != -EAGAIN) {
+                        failed = true;
+                        completed.push_back(req.buffer);
+                        continue;
+                    }
+                    auto n = static_cast<size_t>(std::max(cqe.res, 0));
+                    if (n < req.size) {
+                        req.data += n;
+                        req.size -= n;
+                        req.offset += n;
+                        queued.push_front(req);
+                    } else {
+                        completed.push_back(req.buffer);
+                    }
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+        };
+    }
+
+    /**
+     * @brief An output stream buffer which writes to a file descriptor asynchronously.
+     * @details Output is collected in one of a small fixed pool of buffers. When that buffer is full, or on
+     * sync(), it is submitted to io_uring (using registered buffers) and output continues into the next free
+     * buffer while the write is in flight. The producer only waits when every buffer is in flight. If io_uring
+     * is not available the writes are performed by a background thread instead. Call drain() to wait for all
+     * submitted output to reach the file descriptor; the destructor does this.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_uring_ostreambuf : public std::basic_streambuf<CharT, Traits> {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef typename Traits::int_type int_type;
+        typedef typename Traits::pos_type pos_type;
+        typedef typename Traits::off_type off_type;
+
+        static constexpr size_t default_buffer_size = 64 * 1024;
+        static constexpr size_t default_buffer_count = 4;
+
+        /**
+         * @brief How writes are performed.
+         */
+        enum class backend {
+            automatic,      ///< io_uring when available, otherwise a writer thread.
+            threaded,       ///< Always use a writer thread.
+        };
+
+        basic_uring_ostreambuf() = delete;
+        basic_uring_ostreambuf(const basic_uring_ostreambuf &) = delete;
+        basic_uring_ostreambuf &operator=(const basic_uring_ostreambuf &) = delete;
+
+        /**
+         * @brief (constructor)
+         * @param fd the file descriptor to write to.
+         * @param buffer_size the size of each pool buffer in characters.
+         * @param buffer_count the number of pool buffers, at least 2.
+         * @param owns_fd if true the file descriptor is closed when the buffer is destroyed.
+         * @param mode the write mechanism.
+         */
+        explicit basic_uring_ostreambuf(int fd, size_t buffer_size = default_buffer_size,
+                                        size_t buffer_count = default_buffer_count, bool owns_fd = false,
+                                        backend mode = backend::automatic)
+                : fd{fd}, owns_fd{owns_fd}, buffer_size{std::max<size_t>(buffer_size, 1)},
+                  buffer_count{std::max<size_t>(buffer_count, 2)} {
+            pool_bytes = this->buffer_size * this->buffer_count * sizeof(char_type);
+            pool = static_cast<char_type *>(::mmap(nullptr, pool_bytes, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (pool == MAP_FAILED)
+                throw std::bad_alloc{};
+
+            if (mode == backend::automatic)
+                writer = detail::uring_writer::create(fd, reinterpret_cast<char *>(pool),
+                                                      this->buffer_size * sizeof(char_type), this->buffer_count);
+            uses_uring = static_cast<bool>(writer);
+            if (!writer)
+                writer = std::make_unique<detail::thread_writer>(fd);
+
+            for (size_t idx = this->buffer_count; idx > 1; --idx)
+                free_buffers.push_back(idx - 1);
+            set_buffer(0);
+        }
+
+        /**
+         * @brief (destructor)
+         * @details Submit buffered output and wait for all writes to complete.
+         */
+        ~basic_uring_ostreambuf() override {
+            drain();
+            writer.reset();
+            ::munmap(pool, pool_bytes);
+            if (owns_fd)
+                ::close(fd);
+        }
+
+        /**
+         * @brief Submit buffered output and wait until every submitted write has completed.
+         * @return -1 if any write failed, 0 otherwise.
+         */
+        int drain() {
+            int result = sync();
+            while (outstanding) {
+                if (!reclaim())
+                    result = -1;
+            }
+            return failed ? -1 : result;
+        }
+
+        /**
+         * @brief True if writes are submitted through io_uring, false if the writer thread is used.
+         */
+        bool using_io_uring() const { return uses_uring; }
+
+    protected:
+        int fd;
+        bool owns_fd;
+        bool uses_uring{false};
+        bool failed{false};
+        size_t buffer_size;
+        size_t buffer_count;
+        size_t pool_bytes{0};
+        char_type *pool{nullptr};
+        size_t current{0};
+        size_t outstanding{0};
+        std::vector<size_t> free_buffers{};
+        std::unique_ptr<detail::async_writer> writer{};
+
+        void set_buffer(size_t index) {
+            current = index;
+            auto base = pool + index * buffer_size;
+            this->setp(base, base + buffer_size);
+        }
+
+        /**
+         * @brief Wait for one write to complete and return its buffer to the free list.
+         * @details If the writer has nothing left to complete, the writes still outstanding are given up on and
+         * their buffers are not reused.
+         * @return false if the write failed.
+         */
+        bool reclaim() {
+            typedef detail::async_writer::completion completion;
+            size_t index = 0;
+            auto status = writer->wait(index);
+            if (status == completion::none) {
+                outstanding = 0;
+                failed = true;
+                return false;
+            }
+            --outstanding;
+            free_buffers.push_back(index);
+            failed = failed || status != completion::written;
+            return status == completion::written;
+        }
+
+        /**
+         * @brief Submit the current buffer, if it holds any output, and switch to a free one.
+         * @return -1 on failure, 0 otherwise.
+         */
+        int sync() override {
+            if (this->pptr() == this->pbase())
+                return failed ? -1 : 0;
+
+            auto bytes = static_cast<size_t>(this->pptr() - this->pbase()) * sizeof(char_type);
+            if (failed || !writer->submit(current, reinterpret_cast<const char *>(this->pbase()), bytes)) {
+                failed = true;
+                this->setp(this->pbase(), this->epptr());
+                return -1;
+            }
+            ++outstanding;
+
+            if (free_buffers.empty())
+                reclaim();
+            if (free_buffers.empty()) {
+                // Every buffer may still be in flight, so there is nowhere left to put output.
+                this->setp(nullptr, nullptr);
+                return -1;
+            }
+            auto index = free_buffers.back();
+            free_buffers.pop_back();
+            set_buffer(index);
+            return failed ? -1 : 0;
+        }
+
+        /**
+         * @brief Handle overflow characters
+         * @param c the overflow character
+         * @return EOF if sync() fails, otherwise c as an integer.
+         */
+        int_type overflow(int_type c) override {
+            if (sync() < 0)
+                return traits_type::eof();
+
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *this->pptr() = traits_type::to_char_type(c);
+                this->pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+    };
+
+    using uring_ostreambuf = basic_uring_ostreambuf<char>;
+}
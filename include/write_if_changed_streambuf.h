@@ -0,0 +1,278 @@
+//
+// Created by richard on 2019-04-23.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include "fd_streambuf.h"
+
+namespace exp {
+
+    /**
+     * @brief An output stream buffer which replaces a file only if what is written differs from it.
+     * @details The existing file is memory mapped (or read in chunks if it can not be mapped) and output is
+     * compared with it as it is written; while they match nothing is stored beyond the put area. At the first
+     * difference a temporary file is created next to the target, the matching prefix is copied into it from
+     * the existing file and the rest of the output is written straight to it. close(), or the destructor,
+     * renames the temporary file over the target, so the target is replaced atomically, and only if the
+     * content changed; an unchanged file keeps its modification time.
+     * @tparam CharT the character type
+     * @tparam Traits the character traits type (usually std::char_traits<CharT>
+     */
+    template<typename CharT, typename Traits = std::char_traits<CharT>>
+    class basic_write_if_changed_streambuf
+            : public std::basic_streambuf<CharT, Traits>, public basic_gather_sink<CharT, Traits> {
+    public:
+        typedef CharT char_type;
+        typedef Traits traits_type;
+        typedef typename Traits::int_type int_type;
+        typedef typename Traits::pos_type pos_type;
+        typedef typename Traits::off_type off_type;
+        typedef typename basic_gather_sink<CharT, Traits>::segment_type segment_type;
+
+        static constexpr size_t default_buffer_size = 64 * 1024;
+
+        basic_write_if_changed_streambuf() = delete;
+        basic_write_if_changed_streambuf(const basic_write_if_changed_streambuf &) = delete;
+        basic_write_if_changed_streambuf &operator=(const basic_write_if_changed_streambuf &) = delete;
+
+        /**
+         * @brief (constructor)
+         * @param path the file to write.
+         * @param buffer_size the size of the put area in characters.
+         */
+        explicit basic_write_if_changed_streambuf(std::string path, size_t buffer_size = default_buffer_size)
+                : path{std::move(path)}, buffer{std::make_unique<char_type[]>(std::max<size_t>(buffer_size, 1))} {
+            this->setp(buffer.get(), buffer.get() + std::max<size_t>(buffer_size, 1));
+            existing_fd = ::open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st{};
+            if (existing_fd >= 0 && ::fstat(existing_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                existing_size = static_cast<size_t>(st.st_size);
+                mode = st.st_mode & 07777;
+                if (existing_size) {
+                    mapped = ::mmap(nullptr, existing_size, PROT_READ, MAP_PRIVATE, existing_fd, 0);
+                    if (mapped != MAP_FAILED)
+                        ::madvise(mapped, existing_size, MADV_SEQUENTIAL);
+                }
+            } else {
+                if (existing_fd >= 0)
+                    ::close(existing_fd);
+                existing_fd = -1;
+            }
+        }
+
+        /**
+         * @brief (destructor)
+         * @details Finish the file if close() has not been called.
+         */
+        ~basic_write_if_changed_streambuf() override {
+            close();
+            release_existing();
+        }
+
+        /**
+         * @brief Finish writing: replace the file if the output differs from it, otherwise leave it untouched.
+         * @details Writes after close() are refused.
+         * @return false if the file could not be written.
+         */
+        bool close() {
+            if (closed)
+                return !failed;
+            flush();
+            closed = true;
+            this->setp(nullptr, nullptr);
+
+            if (!failed && !diverged && existing_fd >= 0 && matched == existing_size)
+                return true;
+            if (!failed && !diverged)
+                diverge();
+
+            temp.reset();
+            if (!failed && ::rename(temp_path.c_str(), path.c_str()) != 0)
+                failed = true;
+            if (failed && !temp_path.empty())
+                ::unlink(temp_path.c_str());
+            replaced = !failed;
+            release_existing();
+            return !failed;
+        }
+
+        /**
+         * @brief True once close() has replaced the file.
+         */
+        bool changed() const {
+            return replaced;
+        }
+
+        std::streamsize gather_write(const segment_type *segments, size_t count) override {
+            if (!flush())
+                return 0;
+            std::streamsize total = 0;
+            for (size_t idx = 0; idx < count; ++idx) {
+                if (!consume(segments[idx].data(), segments[idx].size()))
+                    break;
+                total += static_cast<std::streamsize>(segments[idx].size());
+            }
+            return total;
+        }
+
+    protected:
+        std::string path;
+        std::string temp_path{};
+        std::unique_ptr<char_type[]> buffer;
+        std::unique_ptr<basic_fd_streambuf<CharT, Traits>> temp{};
+        int existing_fd{-1};
+        size_t existing_size{0};                ///< In bytes.
+        void *mapped{MAP_FAILED};
+        mode_t mode{0};                         ///< The permissions of the existing file.
+        size_t matched{0};                      ///< Bytes of output equal to the start of the existing file.
+        bool diverged{false};                   ///< Output goes to the temporary file.
+        bool failed{false};
+        bool closed{false};
+        bool replaced{false};
+
+        void release_existing() {
+            if (mapped != MAP_FAILED)
+                ::munmap(mapped, existing_size);
+            mapped = MAP_FAILED;
+            if (existing_fd >= 0)
+                ::close(existing_fd);
+            existing_fd = -1;
+        }
+
+        /**
+         * @brief Compare bytes of the existing file at offset with data.
+         */
+        bool existing_equals(size_t offset, const char *data, size_t bytes) {
+            if (mapped != MAP_FAILED)
+                return std::memcmp(static_cast<const char *>(mapped) + offset, data, bytes) == 0;
+
+            char chunk[16 * 1024];
+            while (bytes) {
+                auto n = ::pread(existing_fd, chunk, std::min(bytes, sizeof(chunk)), static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0 || std::memcmp(chunk, data, static_cast<size_t>(n)) != 0)
+                    return false;
+                offset += static_cast<size_t>(n);
+                data += n;
+                bytes -= static_cast<size_t>(n);
+            }
+            return true;
+        }
+
+        /**
+         * @brief Create a new temporary file next to the target.
+         * @details A new target gets the permissions open(2) gives 0666 under the process umask, which is
+         * never changed; a replacement gets the permissions of the file it replaces.
+         * @return the file descriptor, -1 on failure.
+         */
+        int create_temp() {
+            static std::atomic<unsigned> serial{0};
+            for (int attempt = 0; attempt < 100; ++attempt) {
+                temp_path = path + '.' + std::to_string(::getpid()) + '.' + std::to_string(serial++);
+                int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+                if (fd >= 0) {
+                    if (existing_fd >= 0)
+                        ::fchmod(fd, mode);
+                    return fd;
+                }
+                if (errno != EEXIST)
+                    break;
+            }
+            temp_path.clear();
+            return -1;
+        }
+
+        /**
+         * @brief Start the temporary file with the part of the existing file which matched the output.
+         */
+        void diverge() {
+            diverged = true;
+            int fd = create_temp();
+            if (fd < 0) {
+                failed = true;
+                return;
+            }
+            temp = std::make_unique<basic_fd_streambuf<CharT, Traits>>(fd, 0, true);
+
+            char chunk[16 * 1024];
+            for (size_t offset = 0; offset < matched && !failed;) {
+                const char *data = chunk;
+                ssize_t n;
+                if (mapped != MAP_FAILED) {
+                    data = static_cast<const char *>(mapped) + offset;
+                    n = static_cast<ssize_t>(matched - offset);
+                } else {
+                    n = ::pread(existing_fd, chunk, std::min(matched - offset, sizeof(chunk)), static_cast<off_t>(offset));
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                }
+                failed = n <= 0 || !write_temp(data, static_cast<size_t>(n));
+                offset += static_cast<size_t>(std::max<ssize_t>(n, 0));
+            }
+        }
+
+        bool write_temp(const void *data, size_t bytes) {
+            segment_type segment{static_cast<const char_type *>(data), bytes / sizeof(char_type)};
+            return temp->gather_write(&segment, 1) == static_cast<std::streamsize>(segment.size());
+        }
+
+        /**
+         * @brief Compare output with the existing file, or write it to the temporary file once they differ.
+         */
+        bool consume(const char_type *text, size_t count) {
+            if (failed || closed)
+                return false;
+            auto data = reinterpret_cast<const char *>(text);
+            auto bytes = count * sizeof(char_type);
+            if (!diverged) {
+                if (existing_fd >= 0 && matched + bytes <= existing_size && existing_equals(matched, data, bytes)) {
+                    matched += bytes;
+                    return true;
+                }
+                diverge();
+            }
+            failed = failed || !write_temp(data, bytes);
+            return !failed;
+        }
+
+        bool flush() {
+            auto count = static_cast<size_t>(this->pptr() - this->pbase());
+            this->setp(this->pbase(), this->epptr());
+            return consume(this->pbase(), count);
+        }
+
+        std::streamsize xsputn(const char_type *s, std::streamsize count) override {
+            if (count < this->epptr() - this->pptr()) {
+                traits_type::copy(this->pptr(), s, static_cast<size_t>(count));
+                this->pbump(static_cast<int>(count));
+                return count;
+            }
+            return flush() && consume(s, static_cast<size_t>(count)) ? count : 0;
+        }
+
+        int_type overflow(int_type c) override {
+            if (!flush())
+                return traits_type::eof();
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *this->pptr() = traits_type::to_char_type(c);
+                this->pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        int sync() override {
+            return flush() ? 0 : -1;
+        }
+    };
+
+    using write_if_changed_streambuf = basic_write_if_changed_streambuf<char>;
+}
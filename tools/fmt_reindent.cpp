@@ -0,0 +1,273 @@
+//
+// Created by richard on 2019-04-17.
+//
+
+// fmt_reindent: normalize the indentation of brace structured source through the fmtstream engine.
+//
+// Usage: fmt_reindent [-i] [-s] [-j threads] [-n spaces] [file ...]
+//   With no files, standard input is re-indented to standard output.
+//   -i          rewrite files in place instead of writing them to standard output in order.
+//   -s          report throughput on standard error.
+//   -j threads  number of threads: files are processed in parallel, a single large input is
+//               formatted with fmt::format_parallel.
+//   -n spaces   spaces per indent level, default 4.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "../include/fd_streambuf.h"
+#include "../include/format_parallel.h"
+
+namespace {
+
+    struct options {
+        bool in_place{false};
+        bool stats{false};
+        size_t threads{1};
+        size_t indent_increment{4};
+    };
+
+    /**
+     * @brief Read-only contents of an input, memory mapped when large.
+     */
+    class input_file {
+    public:
+        static constexpr size_t mmap_threshold = 64 * 1024;
+
+        explicit input_file(int fd) {
+            struct stat st{};
+            if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && static_cast<size_t>(st.st_size) >= mmap_threshold) {
+                mapped_size = static_cast<size_t>(st.st_size);
+                mapped = ::mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    ::madvise(mapped, mapped_size, MADV_SEQUENTIAL);
+                    return;
+                }
+            }
+
+            char buffer[64 * 1024];
+            ssize_t n;
+            while ((n = ::read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+                if (n > 0)
+                    contents.append(buffer, static_cast<size_t>(n));
+            ok = n == 0;
+        }
+
+        ~input_file() {
+            if (mapped != MAP_FAILED)
+                ::munmap(mapped, mapped_size);
+        }
+
+        input_file(const input_file &) = delete;
+        input_file &operator=(const input_file &) = delete;
+
+        std::string_view text() const {
+            if (mapped != MAP_FAILED)
+                return {static_cast<const char *>(mapped), mapped_size};
+            return contents;
+        }
+
+        bool good() const { return ok; }
+
+    protected:
+        void *mapped{MAP_FAILED};
+        size_t mapped_size{0};
+        std::string contents{};
+        bool ok{true};
+    };
+
+    /**
+     * @brief Translate source into fmtstream input: an indent code after each opening brace and an undent
+     * code before each closing brace, ignoring braces in comments and literals.
+     */
+    void translate(std::string_view source, std::string &out) {
+        enum class state { code, line_comment, block_comment, string, character };
+        auto current = state::code;
+
+        out.clear();
+        out.reserve(source.size() + source.size() / 16);
+        size_t run = 0;
+        for (size_t idx = 0; idx < source.size(); ++idx) {
+            char c = source[idx];
+            char next = idx + 1 < source.size() ? source[idx + 1] : '\0';
+            switch (current) {
+                case state::code:
+                    if (c == '{' || c == '}') {
+                        out.append(source.substr(run, idx - run));
+                        if (c == '{') {
+                            out.push_back('{');
+                            out.push_back(fmt::control_codes<char>::indent_code);
+                        } else {
+                            out.push_back(fmt::control_codes<char>::undent_code);
+                            out.push_back('}');
+                        }
+                        run = idx + 1;
+                    } else if (c == '/' && next == '/') {
+                        current = state::line_comment;
+                        ++idx;
+                    } else if (c == '/' && next == '*') {
+                        current = state::block_comment;
+                        ++idx;
+                    } else if (c == '"') {
+                        current = state::string;
+                    } else if (c == '\'') {
+                        current = state::character;
+                    }
+                    break;
+                case state::line_comment:
+                    if (c == '\n')
+                        current = state::code;
+                    break;
+                case state::block_comment:
+                    if (c == '*' && next == '/') {
+                        current = state::code;
+                        ++idx;
+                    }
+                    break;
+                case state::string:
+                case state::character:
+                    if (c == '\\')
+                        ++idx;
+                    else if (c == (current == state::string ? '"' : '\'') || c == '\n')
+                        current = state::code;
+                    break;
+            }
+        }
+        out.append(source.substr(run));
+    }
+
+    /**
+     * @brief Re-indent source into sink.
+     * @return false if the sink failed.
+     */
+    bool reindent(std::string_view source, std::streambuf *sink, const options &opts, size_t threads) {
+        std::string translated{};
+        translate(source, translated);
+
+        fmt::fmtstreambuf formatter{sink};
+        formatter.indent_increment = opts.indent_increment;
+        formatter.keep_blank_lines = true;
+        auto n = fmt::format_parallel(std::string_view{translated}, formatter, threads);
+        return n == static_cast<std::streamsize>(translated.size()) && sink->pubsync() == 0;
+    }
+
+    struct file_result {
+        bool ok{false};
+        size_t bytes_in{0};
+        std::string output{};
+    };
+
+    file_result process_file(const char *path, const options &opts, size_t threads) {
+        file_result result{};
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            std::fprintf(stderr, "fmt_reindent: %s: %s\n", path, std::strerror(errno));
+            return result;
+        }
+        input_file input{fd};
+        ::close(fd);
+        if (!input.good()) {
+            std::fprintf(stderr, "fmt_reindent: %s: read failed\n", path);
+            return result;
+        }
+        result.bytes_in = input.text().size();
+
+        if (!opts.in_place) {
+            fmt::detail::basic_string_sink<char> sink{};
+            result.ok = reindent(input.text(), &sink, opts, threads);
+            result.output = std::move(sink.text);
+            return result;
+        }
+
+        std::string temp = std::string{path} + ".reindent.tmp";
+        int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            std::fprintf(stderr, "fmt_reindent: %s: %s\n", temp.c_str(), std::strerror(errno));
+            return result;
+        }
+        struct stat st{};
+        if (::stat(path, &st) == 0)
+            ::fchmod(out, st.st_mode & 07777);
+        {
+            exp::fd_streambuf sink{out, 64 * 1024, true};
+            result.ok = reindent(input.text(), &sink, opts, threads);
+        }
+        if (result.ok)
+            result.ok = ::rename(temp.c_str(), path) == 0;
+        if (!result.ok) {
+            std::fprintf(stderr, "fmt_reindent: %s: write failed\n", path);
+            ::unlink(temp.c_str());
+        }
+        return result;
+    }
+}
+
+int main(int argc, char **argv) {
+    options opts{};
+    int opt;
+    while ((opt = ::getopt(argc, argv, "isj:n:")) != -1) {
+        switch (opt) {
+            case 'i':
+                opts.in_place = true;
+                break;
+            case 's':
+                opts.stats = true;
+                break;
+            case 'j':
+                opts.threads = std::max<size_t>(std::strtoul(optarg, nullptr, 10), 1);
+                break;
+            case 'n':
+                opts.indent_increment = std::strtoul(optarg, nullptr, 10);
+                break;
+            default:
+                std::fprintf(stderr, "usage: fmt_reindent [-i] [-s] [-j threads] [-n spaces] [file ...]\n");
+                return 2;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes_in = 0;
+    bool ok = true;
+    exp::fd_streambuf out{STDOUT_FILENO, 64 * 1024};
+    std::vector<const char *> paths(argv + optind, argv + argc);
+
+    if (paths.empty()) {
+        input_file input{STDIN_FILENO};
+        bytes_in = input.text().size();
+        ok = input.good() && reindent(input.text(), &out, opts, opts.threads);
+    } else if (paths.size() == 1) {
+        auto result = process_file(paths[0], opts, opts.threads);
+        bytes_in = result.bytes_in;
+        ok = result.ok && out.sputn(result.output.data(), static_cast<std::streamsize>(result.output.size())) ==
+                          static_cast<std::streamsize>(result.output.size());
+    } else {
+        std::vector<file_result> results(paths.size());
+        fmt::detail::parallel_for(paths.size(), opts.threads, [&](size_t idx) {
+            results[idx] = process_file(paths[idx], opts, 1);
+        });
+        for (auto &result : results) {
+            bytes_in += result.bytes_in;
+            ok = ok && result.ok;
+            if (result.ok && !result.output.empty())
+                out.sputn(result.output.data(), static_cast<std::streamsize>(result.output.size()));
+        }
+    }
+    ok = out.pubsync() == 0 && ok;
+
+    if (opts.stats) {
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::fprintf(stderr, "fmt_reindent: %zu file(s), %zu bytes in %.3f s, %.1f MB/s\n",
+                     paths.empty() ? size_t{1} : paths.size(), bytes_in, seconds,
+                     seconds > 0 ? static_cast<double>(bytes_in) / seconds / 1e6 : 0.0);
+    }
+    return ok ? 0 : 1;
+}